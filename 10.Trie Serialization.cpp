@@ -23,34 +23,28 @@ An example of test data: trie tree <a<b<e<>>c<>d<f<>>>>, denote the following st
  /       \
 e         f
 
-The first thing to be clear about this question is that you can't use BFS. Because BFS takes 
-up too much space, the space complexity is O(26^h), and h is the height of the tree.
-Then you can only use DFS. And we know that if you want to restore the binary tree directly 
-with the results of DFS, you need at least two different ways to traverse the results. Not to 
-mention that this is Trie, the situation will be more complicated.
+Serialize:
+The trie is written in binary as LOUDS (level-order unary degree sequence),
+see the comment above LOUDS_HEADER for the exact layout. Nodes are visited
+level by level with children in label order; each node contributes one 1 bit
+per child followed by a 0, after a "10" for a virtual super root, and the
+edge labels follow in the same order. For the example, nodes in level order
+are root, a, b, c, d, e, f with 1, 3, 1, 0, 1, 0, 0 children, so the bits are
 
-Then, a better approach is to document the complete process of DFS traversal, including the 
-process from the parent node to the child node, and the process of returning the parent node 
-from the child node.
-In other words, it is the process of recording the changes in the stack.
+  10 10 1110 10 0 10 0 0
 
-Serialize:
-Here use '+' to represent the stack process, '-' to indicate the stack process, then for the 
-tree in example, when 'a' is accessed as a child of root, it should be added to the result string. 
-"+a".
-When returning 'b' from 'e', ​​a "-" should be added to the result to indicate that 
-'e' is popped.
-Then the process of accessing from 'e' to 'e' and then returning from 'e' to 'a' can be expressed 
-as "+a+b+e--". After this is done, the rest of the stack is root and 'a ', the next one to be 
-accessed is the next child node 'c' of 'a'.
+and the labels "abcdef": a u32 count, one 64-bit word of bits and 6 labels,
+18 bytes. That is about 2 bits + 1 byte per node, against 3 bytes per node
+for a "+a+b+e--..." text of the DFS stack changes.
 
 Deserialize:
-Restoring the entire tree only requires converting the previous results into a stack access 
-process.
-When a '+' is encountered, the next character is pushed onto the stack, and since it is DFS, 
-the character must be a child of the current top node.
-When a '-' is encountered, a node is popped.
-Until the entire string is traversed.
+Node ids are level-order positions, root 0, so reading the bits in order
+while counting zeros gives the parent of every 1 bit: the first 0 closes the
+super root and the (k+2)-th closes node k, and counting from 0 the i-th 1 is
+node i. One pass with no recursion rebuilds
+the TrieNodes (Solution::deserialize) or two flat arrays (ArenaTrie).
+LoudsTrie answers lookups on the bytes directly: the children of node k start
+after the (k+1)-th 0, found with select.
 
 */
 
@@ -66,21 +60,641 @@ Until the entire string is traversed.
 #include <map>
 #include <set>
 #include <string>
+#include <string_view>
 #include <list>
 #include <stack>
+#include <chrono>
+#include <random>
+#include <cstdint>
+#include <cstring>
+#include <cstddef>
+#include <memory>
 #include <algorithm>
 #include <iostream>
+#include <fstream>
 #include <iterator>
 #include <sstream> 
 #include <cassert>
 #include <climits>
 
+#include <fcntl.h>
+#include <malloc.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
 using namespace std;
 
 struct TrieNode {
   unordered_map<char, TrieNode*> children;
 };
 
+// Frees a trie built with new, without recursion
+void deleteTrie(TrieNode* root) {
+  vector<TrieNode*> pending;
+
+  if (root != nullptr) {
+    pending.push_back(root);
+  }
+
+  while (!pending.empty()) {
+    TrieNode* node = pending.back();
+
+    pending.pop_back();
+
+    for (auto& entry: node->children) {
+      pending.push_back(entry.second);
+    }
+
+    delete node;
+  }
+}
+
+/*
+ * Binary LOUDS (level-order unary degree sequence) layout of a trie of n
+ * nodes, little-endian:
+ *
+ *   u32 n
+ *   2n + 1 bits, padded to 64-bit words: "10" for a virtual super root,
+ *   then for each node in level order a 1 per child followed by a 0
+ *   n - 1 labels, of each node but the root in level order
+ *
+ * Node ids are level order positions, root 0. The children of a node get
+ * consecutive ids and are stored in label order, so their labels form a
+ * sorted run that can be binary searched. About 2 bits + 1 byte per node.
+ */
+const size_t LOUDS_HEADER = 4;
+
+inline size_t loudsWords(size_t nodes) {
+  return (2 * nodes + 1 + 63) / 64;
+}
+
+// Writes the layout above for n nodes in level order, given each node's
+// child count and the label of the edge into it
+template <class Degree, class Label>
+string encodeLouds(uint32_t n, Degree degree, Label label) {
+  size_t words = loudsWords(n);
+  string s(LOUDS_HEADER + words * 8 + n - 1, 0);
+  char* bitsOut = &s[LOUDS_HEADER];
+  char* labelsOut = bitsOut + words * 8 - 1;
+  uint64_t bits = 1;
+  size_t pos = 2;
+
+  memcpy(&s[0], &n, sizeof(n));
+
+  for (uint32_t i = 0; i < n; i++) {
+    size_t ones = degree(i);
+
+    if (i > 0) {
+      labelsOut[i] = label(i);
+    }
+
+    // ones then a zero, flushing each full word
+    while (ones > 0) {
+      size_t take = min(ones, 64 - pos % 64);
+
+      bits |= (take == 64 ? ~0ULL : ((1ULL << take) - 1)) << pos % 64;
+      pos += take;
+      ones -= take;
+
+      if (pos % 64 == 0) {
+        memcpy(bitsOut + (pos / 64 - 1) * 8, &bits, sizeof(bits));
+        bits = 0;
+      }
+    }
+
+    if (++pos % 64 == 0) {
+      memcpy(bitsOut + (pos / 64 - 1) * 8, &bits, sizeof(bits));
+      bits = 0;
+    }
+  }
+
+  if (pos % 64 != 0) {
+    memcpy(bitsOut + pos / 64 * 8, &bits, sizeof(bits));
+  }
+
+  return s;
+}
+
+// Read-only view of a serialized trie, navigated in place with select.
+// Only a small sample of select positions is built; data must outlive it.
+class LoudsTrie {
+public:
+  static const uint32_t NONE = UINT32_MAX;
+
+  explicit LoudsTrie(string_view data): data(data), nodes(0), labels(nullptr) {
+    uint32_t n;
+
+    if (data.size() < LOUDS_HEADER) {
+      return;
+    }
+
+    memcpy(&n, data.data(), sizeof(n));
+
+    if (n == 0 || data.size() != LOUDS_HEADER + loudsWords(n) * 8 + n - 1) {
+      return;
+    }
+
+    // n ones, n + 1 zeros, nothing set past bit 2n and starting with "10"
+    size_t words = loudsWords(n), ones = 0, zeros = 0;
+
+    for (size_t w = 0; w < words; w++) {
+      uint64_t bits = word(w);
+
+      if (w == words - 1 && (2 * (size_t) n + 1) % 64 != 0 && bits >> (2 * (size_t) n + 1) % 64 != 0) {
+        return;
+      }
+
+      // Sample the word holding every SELECT_SAMPLE-th zero
+      size_t valid = w == words - 1 ? 2 * (size_t) n + 1 - w * 64 : 64;
+      size_t wordZeros = valid - __builtin_popcountll(bits);
+
+      while (samples.size() * SELECT_SAMPLE < zeros + wordZeros) {
+        samples.push_back({(uint32_t) w, (uint32_t) zeros});
+      }
+
+      ones += __builtin_popcountll(bits);
+      zeros += wordZeros;
+    }
+
+    if (ones != n || zeros != (size_t) n + 1 || (word(0) & 3) != 1) {
+      samples.clear();
+      return;
+    }
+
+    labels = data.data() + LOUDS_HEADER + words * 8 - 1;
+    nodes = n;
+  }
+
+  bool valid() const {
+    return nodes != 0;
+  }
+
+  size_t size() const {
+    return nodes;
+  }
+
+  // Label of the edge into node, which must not be the root
+  char label(uint32_t node) const {
+    return labels[node];
+  }
+
+  size_t childCount(uint32_t node) const {
+    return onesFrom(select0(node + 1) + 1);
+  }
+
+  // Child of node along label, NONE if there is none
+  uint32_t child(uint32_t node, char label) const {
+    size_t start = select0(node + 1) + 1;
+    size_t count = onesFrom(start);
+    // Ones before start are the ids handed out so far
+    uint32_t first = start - node - 1;
+    const unsigned char* run = (const unsigned char*) labels + first;
+    const unsigned char* it = lower_bound(run, run + count, (unsigned char) label);
+
+    return it != run + count && *it == (unsigned char) label ? first + (it - run) : NONE;
+  }
+
+  // Node reached by following prefix from the root, NONE if it leaves the trie
+  uint32_t find(string_view prefix) const {
+    uint32_t node = 0;
+
+    for (size_t i = 0; i < prefix.size() && node != NONE; i++) {
+      node = child(node, prefix[i]);
+    }
+
+    return node;
+  }
+
+  bool hasPrefix(string_view prefix) const {
+    return find(prefix) != NONE;
+  }
+
+  // Calls f(parent, child, label) for every edge in level order. False if
+  // the bits name a child list before its node exists, or a node's labels
+  // are not strictly increasing.
+  template <class F>
+  bool forEachEdge(F f) const {
+    size_t parent = 0, next = 1, words = loudsWords(nodes);
+    int previous = -1;
+
+    // Skip the super root's "10"
+    for (size_t w = 0; w < words; w++) {
+      uint64_t bits = word(w);
+      size_t end = w == words - 1 ? 2 * nodes + 1 - w * 64 : 64;
+
+      for (size_t b = w == 0 ? 2 : 0; b < end; b++) {
+        if (bits >> b & 1) {
+          int label = (unsigned char) labels[next];
+
+          if (parent >= next || label <= previous) {
+            return false;
+          }
+
+          f(parent, next, labels[next]);
+          previous = label;
+          next++;
+        } else {
+          parent++;
+          previous = -1;
+        }
+      }
+    }
+
+    return true;
+  }
+
+private:
+  static const size_t SELECT_SAMPLE = 512;
+
+  struct Sample {
+    uint32_t word;
+    uint32_t zerosBefore;
+  };
+
+  uint64_t word(size_t w) const {
+    uint64_t bits;
+
+    memcpy(&bits, data.data() + LOUDS_HEADER + w * 8, sizeof(bits));
+
+    return bits;
+  }
+
+  // Position of the r-th zero bit, counting from 1
+  size_t select0(size_t r) const {
+    const Sample& sample = samples[(r - 1) / SELECT_SAMPLE];
+    size_t w = sample.word, before = sample.zerosBefore;
+
+    for (;; w++) {
+      uint64_t zeros = ~word(w);
+      size_t count = __builtin_popcountll(zeros);
+
+      if (before + count >= r) {
+        // Drop the lower zeros until the wanted one is lowest
+        for (size_t k = r - before - 1; k > 0; k--) {
+          zeros &= zeros - 1;
+        }
+
+        return w * 64 + __builtin_ctzll(zeros);
+      }
+
+      before += count;
+    }
+  }
+
+  // Length of the run of ones starting at bit pos
+  size_t onesFrom(size_t pos) const {
+    size_t w = pos / 64, shift = pos % 64;
+    // The shift brings in zeros at the top, which read as ones here
+    uint64_t zeros = ~(word(w) >> shift);
+
+    if (shift == 0 ? zeros != 0 : (size_t) __builtin_ctzll(zeros) < 64 - shift) {
+      return __builtin_ctzll(zeros);
+    }
+
+    size_t count = 64 - shift;
+
+    while ((zeros = ~word(++w)) == 0) {
+      count += 64;
+    }
+
+    return count + __builtin_ctzll(zeros);
+  }
+
+  string_view data;
+  size_t nodes;
+  const char* labels;
+  vector<Sample> samples;
+};
+
+// A node of a trie stored as flat arrays in level order: its children are
+// the nodes firstChild .. firstChild + childCount - 1
+struct FlatTrieNode {
+  uint32_t firstChild;
+  uint32_t childCount;
+};
+
+// Label arrays carry this many readable bytes past their end so a search
+// can load 16 labels at a time
+const size_t LABEL_PADDING = 16;
+
+// Index of label in the sorted run of count labels at run, count if absent
+inline uint32_t findLabel(const char* run, uint32_t count, char label) {
+#ifdef __SSE2__
+  __m128i key = _mm_set1_epi8(label);
+
+  for (uint32_t i = 0; i < count; i += 16) {
+    unsigned mask = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*) (run + i)), key));
+
+    // Bytes past the run belong to other nodes
+    if (count - i < 16) {
+      mask &= (1u << (count - i)) - 1;
+    }
+
+    if (mask) {
+      return i + __builtin_ctz(mask);
+    }
+  }
+
+  return count;
+#else
+  const unsigned char* begin = (const unsigned char*) run;
+  const unsigned char* it = lower_bound(begin, begin + count, (unsigned char) label);
+
+  return it != begin + count && *it == (unsigned char) label ? it - begin : count;
+#endif
+}
+
+// Trie in two flat arrays built in one pass over the LOUDS bits: nodes in
+// level order, each naming the run of its children, and edge labels. About
+// 9 bytes a node, and freeing it is two deallocations. save() writes the
+// arrays as an image for MappedTrie.
+class ArenaTrie {
+public:
+  static const uint32_t NONE = UINT32_MAX;
+
+  // Empty, and not valid(), if data is malformed
+  explicit ArenaTrie(string_view data) {
+    LoudsTrie trie(data);
+
+    if (!trie.valid()) {
+      return;
+    }
+
+    nodes.assign(trie.size(), FlatTrieNode{0, 0});
+    labels.resize(trie.size() + LABEL_PADDING);
+
+    bool ok = trie.forEachEdge([&](size_t parent, size_t child, char label) {
+      if (nodes[parent].childCount++ == 0) {
+        nodes[parent].firstChild = child;
+      }
+
+      labels[child] = label;
+    });
+
+    if (!ok) {
+      nodes.clear();
+      labels.clear();
+    }
+  }
+
+  bool valid() const {
+    return !nodes.empty();
+  }
+
+  size_t size() const {
+    return nodes.size();
+  }
+
+  char label(uint32_t node) const {
+    return labels[node];
+  }
+
+  size_t childCount(uint32_t node) const {
+    return nodes[node].childCount;
+  }
+
+  uint32_t child(uint32_t node, char label) const {
+    const FlatTrieNode& parent = nodes[node];
+    uint32_t i = findLabel(labels.data() + parent.firstChild, parent.childCount, label);
+
+    return i < parent.childCount ? parent.firstChild + i : NONE;
+  }
+
+  uint32_t find(string_view prefix) const {
+    uint32_t node = 0;
+
+    for (size_t i = 0; i < prefix.size() && node != NONE; i++) {
+      node = child(node, prefix[i]);
+    }
+
+    return node;
+  }
+
+  bool hasPrefix(string_view prefix) const {
+    return find(prefix) != NONE;
+  }
+
+  // Back to the LOUDS form; nodes are already in level order
+  string serialize() const {
+    return encodeLouds(nodes.size(), [&](uint32_t i) { return nodes[i].childCount; },
+                       [&](uint32_t i) { return labels[i]; });
+  }
+
+  bool save(const string& path) const;
+
+private:
+  vector<FlatTrieNode> nodes;
+  string labels;
+};
+
+// Trie image written by ArenaTrie::save in host byte order and mapped by
+// MappedTrie. The header is followed by nodeCount FlatTrieNodes and then
+// nodeCount labels plus LABEL_PADDING, each section on an 8 byte boundary.
+// Nodes refer to each other by index, so the image works wherever it is
+// mapped. The header carries a checksum of its own fields, checked on open,
+// and one of the sections, checked only by MappedTrie::verify.
+const char TRIE_IMAGE_MAGIC[8] = {'T', 'R', 'I', 'E', '0', '0', '0', '1'};
+
+struct TrieImageHeader {
+  char magic[8];
+  uint64_t fileSize;
+  uint64_t nodeCount;
+  uint64_t nodeOffset;
+  uint64_t labelOffset;
+  uint64_t bodyChecksum;
+  uint64_t headerChecksum;
+};
+
+// FNV-1a
+uint64_t fnv1a(const void* data, size_t size, uint64_t hash = 14695981039346656037ULL) {
+  const uint8_t* p = static_cast<const uint8_t*>(data);
+
+  for (size_t i = 0; i < size; i++) {
+    hash = (hash ^ p[i]) * 1099511628211ULL;
+  }
+
+  return hash;
+}
+
+// Checksum of every header field before headerChecksum
+uint64_t headerChecksum(const TrieImageHeader& header) {
+  return fnv1a(&header, offsetof(TrieImageHeader, headerChecksum));
+}
+
+bool ArenaTrie::save(const string& path) const {
+  TrieImageHeader header = {};
+  size_t offset = sizeof(header);
+  auto place = [&offset](size_t size) {
+    size_t start = (offset + 7) & ~(size_t) 7;
+    offset = start + size;
+    return start;
+  };
+
+  memcpy(header.magic, TRIE_IMAGE_MAGIC, sizeof(header.magic));
+  header.nodeCount = nodes.size();
+  header.nodeOffset = place(nodes.size() * sizeof(FlatTrieNode));
+  header.labelOffset = place(labels.size());
+  header.fileSize = offset;
+
+  // Sections are contiguous: nodes are 8 bytes each, so labels follow them
+  header.bodyChecksum = fnv1a(labels.data(), labels.size(), fnv1a(nodes.data(), nodes.size() * sizeof(FlatTrieNode)));
+  header.headerChecksum = headerChecksum(header);
+
+  ofstream out(path, ios::binary | ios::trunc);
+
+  out.write((const char*) &header, sizeof(header));
+  out.write((const char*) nodes.data(), nodes.size() * sizeof(FlatTrieNode));
+  out.write(labels.data(), labels.size());
+  out.close();
+
+  return !out.fail();
+}
+
+// Read-only trie over an image written by ArenaTrie::save. The file is
+// mapped rather than read, so opening costs a header check whatever the
+// trie size, pages are faulted in as lookups touch them, and processes
+// mapping the same image share them through the page cache. Each step of a
+// lookup checks that the child run lies inside the image, so a damaged body
+// gives wrong answers rather than stray reads; verify() detects it.
+class MappedTrie {
+public:
+  static const uint32_t NONE = UINT32_MAX;
+
+  MappedTrie() : base(nullptr), length(0), header(nullptr), nodes(nullptr), labels(nullptr) { }
+
+  ~MappedTrie() {
+    close();
+  }
+
+  MappedTrie(const MappedTrie&) = delete;
+  MappedTrie& operator=(const MappedTrie&) = delete;
+
+  // Map a trie image, false if it cannot be read or is not a trie image
+  bool open(const string& path) {
+    close();
+
+    int fd = ::open(path.c_str(), O_RDONLY);
+
+    if (fd < 0) {
+      return false;
+    }
+
+    struct stat st;
+    void* p = MAP_FAILED;
+
+    if (fstat(fd, &st) == 0 && (size_t) st.st_size >= sizeof(TrieImageHeader)) {
+      p = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    }
+
+    ::close(fd);
+
+    if (p == MAP_FAILED) {
+      return false;
+    }
+
+    base = static_cast<const uint8_t*>(p);
+    length = st.st_size;
+    header = reinterpret_cast<const TrieImageHeader*>(base);
+
+    if (!valid()) {
+      close();
+      return false;
+    }
+
+    nodes = reinterpret_cast<const FlatTrieNode*>(base + header->nodeOffset);
+    labels = reinterpret_cast<const char*>(base + header->labelOffset);
+
+    return true;
+  }
+
+  void close() {
+    if (base) {
+      munmap(const_cast<uint8_t*>(base), length);
+    }
+
+    base = nullptr;
+    length = 0;
+    header = nullptr;
+  }
+
+  bool isOpen() const {
+    return base != nullptr;
+  }
+
+  // Whether the nodes and labels match the checksum taken when saved; reads
+  // the whole image
+  bool verify() const {
+    size_t bodySize = header->nodeCount * sizeof(FlatTrieNode) + header->nodeCount + LABEL_PADDING;
+
+    return fnv1a(base + header->nodeOffset, bodySize) == header->bodyChecksum;
+  }
+
+  size_t size() const {
+    return header->nodeCount;
+  }
+
+  char label(uint32_t node) const {
+    return labels[node];
+  }
+
+  size_t childCount(uint32_t node) const {
+    return nodes[node].childCount;
+  }
+
+  uint32_t child(uint32_t node, char label) const {
+    const FlatTrieNode& parent = nodes[node];
+
+    if ((uint64_t) parent.firstChild + parent.childCount > header->nodeCount) {
+      return NONE;
+    }
+
+    uint32_t i = findLabel(labels + parent.firstChild, parent.childCount, label);
+
+    return i < parent.childCount ? parent.firstChild + i : NONE;
+  }
+
+  uint32_t find(string_view prefix) const {
+    uint32_t node = 0;
+
+    for (size_t i = 0; i < prefix.size() && node != NONE; i++) {
+      node = child(node, prefix[i]);
+    }
+
+    return node;
+  }
+
+  bool hasPrefix(string_view prefix) const {
+    return find(prefix) != NONE;
+  }
+
+private:
+  // Whether count items of width bytes at offset lie inside the file
+  bool inFile(uint64_t offset, uint64_t count, size_t width) const {
+    return offset % 8 == 0 && offset <= length && count <= (length - offset) / width;
+  }
+
+  bool valid() const {
+    return memcmp(header->magic, TRIE_IMAGE_MAGIC, sizeof(header->magic)) == 0 &&
+           headerChecksum(*header) == header->headerChecksum &&
+           header->fileSize == length &&
+           header->nodeCount > 0 && header->nodeCount <= UINT32_MAX &&
+           header->labelOffset == header->nodeOffset + header->nodeCount * sizeof(FlatTrieNode) &&
+           inFile(header->nodeOffset, header->nodeCount, sizeof(FlatTrieNode)) &&
+           inFile(header->labelOffset, header->nodeCount + LABEL_PADDING, 1);
+  }
+
+  const uint8_t* base;
+  size_t length;
+  const TrieImageHeader* header;
+  const FlatTrieNode* nodes;
+  const char* labels;
+};
+
 class Solution {
 public:
   /**
@@ -92,16 +706,24 @@ public:
     if (root == nullptr) {
       return "";
     }
-    
-    string s = "";
-    
-    for (auto& entry: root->children) {
-      s += "+" + entry.first;
-      s += serialize(entry.second);
-      s += "-";
+
+    // Level order with each node's children sorted by label
+    vector<pair<TrieNode*, char>> order{{root, 0}};
+    vector<pair<char, TrieNode*>> children;
+
+    for (size_t i = 0; i < order.size(); i++) {
+      children.assign(order[i].first->children.begin(), order[i].first->children.end());
+      sort(children.begin(), children.end(), [](const pair<char, TrieNode*>& a, const pair<char, TrieNode*>& b) {
+        return (unsigned char) a.first < (unsigned char) b.first;
+      });
+
+      for (auto& child: children) {
+        order.push_back({child.second, child.first});
+      }
     }
-    
-    return s;
+
+    return encodeLouds(order.size(), [&](uint32_t i) { return order[i].first->children.size(); },
+                       [&](uint32_t i) { return order[i].second; });
   }
 
   /**
@@ -110,27 +732,292 @@ public:
   * system, it's given by your own serialize method. So the format of data is
   * designed by yourself, and deserialize it here as you serialize it in 
   * "serialize" method.
+  * Returns nullptr if data is malformed.
   */
-  TrieNode* deserialize(string data) {
-    TrieNode* root =  new TrieNode();
-    stack<TrieNode*> st;
-    size_t idx = 0;
-    
-    st.push(root);
-    
-    while (idx < data.length()) {
-      if (data[idx] == '+') {
-          TrieNode* node =  new TrieNode();
-          st.top()->children[data[++idx]] = node;
-          st.push(node);
-      } else if (data[idx] == '-') {
-          st.pop();
-      }
+  TrieNode* deserialize(const string& data) {
+    if (data.empty()) {
+      return new TrieNode();
+    }
+
+    LoudsTrie trie(data);
+
+    if (!trie.valid()) {
+      return nullptr;
+    }
+
+    vector<TrieNode*> nodes(trie.size());
+
+    nodes[0] = new TrieNode();
 
-      idx++;
+    bool ok = trie.forEachEdge([&](size_t parent, size_t child, char label) {
+      nodes[child] = new TrieNode();
+      nodes[parent]->children[label] = nodes[child];
+    });
+
+    if (!ok) {
+      deleteTrie(nodes[0]);
+      return nullptr;
     }
-    
-    return root;
+
+    return nodes[0];
   }
 };
 
+void insertWord(TrieNode* root, const string& word) {
+  for (char c: word) {
+    TrieNode*& child = root->children[c];
+
+    if (child == nullptr) {
+      child = new TrieNode();
+    }
+
+    root = child;
+  }
+}
+
+bool hasPrefix(TrieNode* root, string_view prefix) {
+  for (char c: prefix) {
+    auto it = root->children.find(c);
+
+    if (it == root->children.end()) {
+      return false;
+    }
+
+    root = it->second;
+  }
+
+  return true;
+}
+
+// Dictionary-like words made of 2 to 5 syllables, common syllables first
+vector<string> makeWords(size_t count) {
+  const char* onsets[] = {"", "b", "c", "d", "f", "g", "h", "l", "m", "n", "p", "r", "s", "t", "v", "st", "tr", "ch", "sh", "pr"};
+  const char* nuclei[] = {"a", "e", "i", "o", "u", "ea", "ou", "io", "ai"};
+  const char* codas[] = {"", "", "n", "r", "s", "t", "l", "m", "ng", "ck"};
+  vector<string> syllables;
+  mt19937 rng(1);
+  vector<string> words(count);
+
+  for (auto onset: onsets) {
+    for (auto nucleus: nuclei) {
+      for (auto coda: codas) {
+        syllables.push_back(string(onset) + nucleus + coda);
+      }
+    }
+  }
+
+  shuffle(syllables.begin(), syllables.end(), rng);
+
+  for (auto& word: words) {
+    for (int i = 0, n = 2 + rng() % 4; i < n; i++) {
+      // Product of two uniforms skews towards the front
+      word += syllables[(size_t) rng() % syllables.size() * (rng() % syllables.size()) / syllables.size()];
+    }
+  }
+
+  return words;
+}
+
+// Live heap bytes, including mmapped chunks
+size_t heapBytes() {
+  struct mallinfo2 info = mallinfo2();
+
+  return info.uordblks + info.hblkhd;
+}
+
+double secondsSince(chrono::steady_clock::time_point start) {
+  return chrono::duration<double>(chrono::steady_clock::now() - start).count();
+}
+
+// Size and speed of the LOUDS form on a synthetic dictionary (the old
+// "+c...-" text took 3 bytes per node), then load time, heap, free time and
+// prefix lookups of TrieNodes from deserialize(), the ArenaTrie, the
+// in-place LoudsTrie view and a MappedTrie image
+void benchmark(size_t wordCount) {
+  vector<string> words = makeWords(wordCount);
+  TrieNode* root = new TrieNode();
+
+  for (auto& word: words) {
+    insertWord(root, word);
+  }
+
+  Solution solution;
+  auto start = chrono::steady_clock::now();
+  string data = solution.serialize(root);
+  double serializeSecs = secondsSince(start);
+  double mb = data.size() / (double) (1 << 20);
+  size_t nodes = LoudsTrie(data).size();
+
+  deleteTrie(root);
+
+  cout << wordCount << " words, " << nodes << " nodes, " << (double) data.size() / nodes << " bytes/node, serialize "
+       << mb / serializeSecs << " MB/s (" << nodes / serializeSecs / 1e6 << " M nodes/s)" << endl;
+
+  // Prefixes of random words, a quarter of them changed to miss
+  mt19937 rng(2);
+  vector<string> prefixes;
+
+  for (int i = 0; i < 1000000; i++) {
+    string prefix = words[rng() % words.size()];
+
+    prefix.resize(1 + rng() % prefix.size());
+
+    if (i % 4 == 0) {
+      prefix.back() = 'z';
+    }
+
+    prefixes.push_back(prefix);
+  }
+
+  words.clear();
+  words.shrink_to_fit();
+
+  // TrieNodes last, as the next allocation after freeing them pays to merge
+  // millions of small chunks
+  size_t heap = heapBytes();
+  size_t arenaFound = 0, imageFound = 0, viewFound = 0, nodeFound = 0;
+
+  start = chrono::steady_clock::now();
+
+  auto arena = make_unique<ArenaTrie>(data);
+  double arenaLoadSecs = secondsSince(start);
+  size_t arenaHeap = heapBytes() - heap;
+
+  assert(arena->serialize() == data);
+  start = chrono::steady_clock::now();
+
+  for (auto& prefix: prefixes) {
+    arenaFound += arena->hasPrefix(prefix);
+  }
+
+  double arenaLookupSecs = secondsSince(start);
+
+  // Image of the arena: open cost, first lookup on the fresh mapping,
+  // steady lookups, and a full checksum pass
+  const string path = "trie.img";
+  MappedTrie mapped;
+  const int opens = 1000;
+
+  bool saved = arena->save(path);
+
+  assert(saved);
+  start = chrono::steady_clock::now();
+
+  for (int i = 0; i < opens; i++) {
+    mapped.open(path);
+  }
+
+  double imageOpenSecs = secondsSince(start) / opens;
+
+  start = chrono::steady_clock::now();
+
+  bool first = mapped.hasPrefix(prefixes[0]);
+  double imageFirstSecs = secondsSince(start);
+
+  assert(first == arena->hasPrefix(prefixes[0]));
+
+  start = chrono::steady_clock::now();
+
+  for (auto& prefix: prefixes) {
+    imageFound += mapped.hasPrefix(prefix);
+  }
+
+  double imageLookupSecs = secondsSince(start);
+
+  start = chrono::steady_clock::now();
+  bool verified = mapped.verify();
+  double verifySecs = secondsSince(start);
+
+  assert(verified);
+
+  mapped.close();
+  unlink(path.c_str());
+
+  start = chrono::steady_clock::now();
+  arena.reset();
+
+  double arenaFreeSecs = secondsSince(start);
+
+  start = chrono::steady_clock::now();
+
+  LoudsTrie trie(data);
+  double viewLoadSecs = secondsSince(start);
+
+  start = chrono::steady_clock::now();
+
+  for (auto& prefix: prefixes) {
+    viewFound += trie.hasPrefix(prefix);
+  }
+
+  double viewLookupSecs = secondsSince(start);
+
+  heap = heapBytes();
+  start = chrono::steady_clock::now();
+
+  TrieNode* copy = solution.deserialize(data);
+  double nodeLoadSecs = secondsSince(start);
+  size_t nodeHeap = heapBytes() - heap;
+
+  assert(solution.serialize(copy) == data);
+  start = chrono::steady_clock::now();
+
+  for (auto& prefix: prefixes) {
+    nodeFound += hasPrefix(copy, prefix);
+  }
+
+  double nodeLookupSecs = secondsSince(start);
+
+  start = chrono::steady_clock::now();
+  deleteTrie(copy);
+
+  double nodeFreeSecs = secondsSince(start);
+
+  assert(imageFound == arenaFound && viewFound == arenaFound && nodeFound == arenaFound);
+
+  auto report = [&](const char* name, double loadSecs, size_t bytes, double freeSecs, double lookupSecs) {
+    cout << name << "load " << loadSecs * 1e3 << " ms (" << mb / loadSecs << " MB/s), heap "
+         << (double) bytes / nodes << " bytes/node, free " << freeSecs * 1e3 << " ms, hasPrefix "
+         << lookupSecs / prefixes.size() * 1e9 << " ns" << endl;
+  };
+
+  report("TrieNode   ", nodeLoadSecs, nodeHeap, nodeFreeSecs, nodeLookupSecs);
+  report("ArenaTrie  ", arenaLoadSecs, arenaHeap, arenaFreeSecs, arenaLookupSecs);
+  report("LoudsTrie  ", viewLoadSecs, 0, 0, viewLookupSecs);
+  cout << "MappedTrie open " << imageOpenSecs * 1e6 << " us, first hasPrefix " << imageFirstSecs * 1e6
+       << " us, hasPrefix " << imageLookupSecs / prefixes.size() * 1e9 << " ns, verify " << verifySecs * 1e3 << " ms"
+       << endl;
+}
+
+int main(int argc, char* argv[]) {
+  // <a<b<e<>>c<>d<f<>>>> from the example
+  TrieNode* root = new TrieNode();
+
+  for (string word: {"abe", "ac", "adf"}) {
+    insertWord(root, word);
+  }
+
+  Solution solution;
+  string data = solution.serialize(root);
+  TrieNode* copy = solution.deserialize(data);
+  LoudsTrie trie(data);
+
+  cout << data.size() << " bytes, round trip " << (solution.serialize(copy) == data ? "ok" : "failed") << endl;
+  cout << "ad " << trie.hasPrefix("ad") << " ae " << trie.hasPrefix("ae") << endl;
+
+  // Saved as an image and mapped back
+  MappedTrie mapped;
+
+  if (ArenaTrie(data).save("trie.img") && mapped.open("trie.img")) {
+    cout << "mapped adf " << mapped.hasPrefix("adf") << " abf " << mapped.hasPrefix("abf") << endl;
+  }
+
+  mapped.close();
+  unlink("trie.img");
+
+  deleteTrie(root);
+  deleteTrie(copy);
+
+  if (argc > 1 && string(argv[1]) == "bench") {
+    benchmark(argc > 2 ? stoul(argv[2]) : 2000000);
+  }
+}
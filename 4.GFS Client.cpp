@@ -38,6 +38,13 @@ read("b.txt")
 #include <map>
 #include <set>
 #include <string>
+#include <deque>
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <chrono>
 #include <algorithm>
 #include <iostream>
 #include <iterator>
@@ -65,9 +72,145 @@ private:
   unordered_map<string, unordered_map<int, string>> chunks;
 };
 
+// Piece of a chunk travelling down the replica chain
+struct Packet {
+  int chunkIndex;
+  bool lastOfChunk;
+  bool endOfStream;
+  string data;
+};
+
+// Blocking FIFO between two hops of the replica chain
+class PacketQueue {
+public:
+  void push(Packet packet) {
+    {
+      lock_guard<mutex> lock(mtx);
+      packets.push_back(move(packet));
+    }
+
+    cv.notify_one();
+  }
+
+  Packet pop() {
+    unique_lock<mutex> lock(mtx);
+
+    cv.wait(lock, [this] { return !packets.empty(); });
+
+    Packet packet = move(packets.front());
+    packets.pop_front();
+
+    return packet;
+  }
+
+private:
+  mutex mtx;
+  condition_variable cv;
+  deque<Packet> packets;
+};
+
+// In-process stand-in for a chunkserver. Each server owns an outbound link
+// of limited bandwidth (0 means unlimited) which is what makes the choice
+// between chain forwarding and client fan-out matter.
+class ChunkServer {
+public:
+  ChunkServer(long long linkBytesPerSec) : linkBytesPerSec(linkBytesPerSec), alive(true) { }
+
+  string readChunk(const string& filename, int chunkIndex, bool& found) {
+    lock_guard<mutex> lock(mtx);
+
+    found = false;
+
+    if (!alive) {
+      return "";
+    }
+
+    auto itFile = chunks.find(filename);
+
+    if (itFile == chunks.end()) {
+      return "";
+    }
+
+    auto itChunk = itFile->second.find(chunkIndex);
+
+    if (itChunk == itFile->second.end()) {
+      return "";
+    }
+
+    found = true;
+
+    return itChunk->second;
+  }
+
+  void writeChunk(const string& filename, int chunkIndex, string content) {
+    lock_guard<mutex> lock(mtx);
+    chunks[filename][chunkIndex] = move(content);
+  }
+
+  // Receive packets from inbox, store them and forward each one to the next
+  // replica as soon as it arrives so that all hops transfer concurrently
+  void receiveChain(const string& filename, PacketQueue& inbox, PacketQueue* next) {
+    string pending;
+
+    while (true) {
+      Packet packet = inbox.pop();
+
+      if (packet.endOfStream) {
+        if (next) {
+          next->push(move(packet));
+        }
+
+        return;
+      }
+
+      pending += packet.data;
+
+      if (packet.lastOfChunk) {
+        writeChunk(filename, packet.chunkIndex, move(pending));
+        pending.clear();
+      }
+
+      if (next) {
+        transmit(packet.data.size());
+        next->push(move(packet));
+      }
+    }
+  }
+
+  // Simulate putting bytes on this node's outbound link
+  void transmit(size_t bytes) const {
+    if (linkBytesPerSec > 0) {
+      this_thread::sleep_for(chrono::microseconds(bytes * 1000000 / linkBytesPerSec));
+    }
+  }
+
+  void setAlive(bool value) {
+    lock_guard<mutex> lock(mtx);
+    alive = value;
+  }
+
+private:
+  long long linkBytesPerSec;
+  bool alive;
+  mutex mtx;
+  unordered_map<string, unordered_map<int, string>> chunks;
+};
+
 class GFSClient : public BaseGFSClient {
 public:
-    GFSClient(int chunkSize) : chunkSize(chunkSize) { }
+    enum WriteMode { PIPELINED, FAN_OUT };
+
+    GFSClient(int chunkSize) : GFSClient(chunkSize, 0) { }
+
+    // Replicated mode: every chunk is stored on `replicas` chunkservers
+    GFSClient(int chunkSize, int replicas, WriteMode mode = PIPELINED,
+              int packetSize = 64 * 1024, long long linkBytesPerSec = 0)
+      : chunkSize(chunkSize), mode(mode), packetSize(packetSize),
+        linkBytesPerSec(linkBytesPerSec), nextReplica(0) {
+        for (int i = 0; i < replicas; i++) {
+            servers.emplace_back(new ChunkServer(linkBytesPerSec));
+        }
+    }
     
     // @param filename a file name
     // @return conetent of the file given from GFS
@@ -79,7 +222,7 @@ public:
         string ret; 
 
         for (int i = 0; i < name2Index[filename]; i++) {
-            ret += readChunk(filename, i);
+            ret += servers.empty() ? readChunk(filename, i) : readReplica(filename, i);
         }
         
         return ret;
@@ -97,22 +240,127 @@ public:
         }
         
         name2Index[filename] = chunkNum;
-        
-        for (int i = 0; i < chunkNum; i++) {
-            int start = i * chunkSize;
-            int end = min((int) content.length(), (i + 1) * chunkSize);
-            writeChunk(filename, i, content.substr(start, end));
+
+        if (servers.empty()) {
+            for (int i = 0; i < chunkNum; i++) {
+                writeChunk(filename, i, content.substr(i * chunkSize, chunkSize));
+            }
+        } else if (mode == PIPELINED) {
+            writePipelined(filename, content, chunkNum);
+        } else {
+            writeFanOut(filename, content, chunkNum);
         }
     }
 
+    ChunkServer& replica(int index) {
+        return *servers[index];
+    }
+
 private:
+    // Push every chunk once to the first replica, which forwards it down the chain
+    void writePipelined(const string& filename, const string& content, int chunkNum) {
+        int replicas = servers.size();
+        vector<PacketQueue> queues(replicas);
+        vector<thread> workers;
+
+        for (int r = 0; r < replicas; r++) {
+            PacketQueue* next = r + 1 < replicas ? &queues[r + 1] : nullptr;
+            workers.emplace_back(&ChunkServer::receiveChain, servers[r].get(),
+                                 cref(filename), ref(queues[r]), next);
+        }
+
+        for (int i = 0; i < chunkNum; i++) {
+            string chunk = content.substr(i * chunkSize, chunkSize);
+
+            for (size_t offset = 0; offset < chunk.size(); offset += packetSize) {
+                bool last = offset + packetSize >= chunk.size();
+
+                clientLink.transmit(min<size_t>(packetSize, chunk.size() - offset));
+                queues[0].push({i, last, false, chunk.substr(offset, packetSize)});
+            }
+        }
+
+        queues[0].push({0, false, true, ""});
+
+        for (auto& worker : workers) {
+            worker.join();
+        }
+    }
+
+    // Client uploads each chunk to every replica over its own link
+    void writeFanOut(const string& filename, const string& content, int chunkNum) {
+        for (int i = 0; i < chunkNum; i++) {
+            string chunk = content.substr(i * chunkSize, chunkSize);
+
+            for (auto& server : servers) {
+                clientLink.transmit(chunk.size());
+                server->writeChunk(filename, i, chunk);
+            }
+        }
+    }
+
+    // Spread reads round robin over replicas and fall back to the next on failure
+    string readReplica(const string& filename, int chunkIndex) {
+        int replicas = servers.size();
+        int start = nextReplica.fetch_add(1, memory_order_relaxed) % replicas;
+
+        for (int k = 0; k < replicas; k++) {
+            bool found;
+            string data = servers[(start + k) % replicas]->readChunk(filename, chunkIndex, found);
+
+            if (found) {
+                return data;
+            }
+        }
+
+        return "";
+    }
+
     unordered_map<string, int> name2Index;
     int chunkSize;
+    WriteMode mode;
+    int packetSize;
+    long long linkBytesPerSec;
+    vector<unique_ptr<ChunkServer>> servers;
+    ChunkServer clientLink{linkBytesPerSec};
+    atomic<unsigned> nextReplica;
 };
 
-int main() {
+// Write throughput for R = 1..3 replicas with a bandwidth limited link per node
+void benchmark() {
+    const int chunkSize = 1 << 20;
+    const long long linkBytesPerSec = 256LL << 20;
+    string content(16 * chunkSize, 'x');
+
+    for (int replicas = 1; replicas <= 3; replicas++) {
+        for (auto mode : {GFSClient::PIPELINED, GFSClient::FAN_OUT}) {
+            GFSClient client(chunkSize, replicas, mode, 64 * 1024, linkBytesPerSec);
+
+            auto start = chrono::steady_clock::now();
+            client.write("bench", content);
+            double secs = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+            assert(client.read("bench") == content);
+
+            cout << "R=" << replicas << (mode == GFSClient::PIPELINED ? " pipelined " : " fan-out   ")
+                 << (content.size() / secs / (1 << 20)) << " MB/s" << endl;
+        }
+    }
+}
+
+int main(int argc, char* argv[]) {
   GFSClient gfsClient(4);
 
   gfsClient.write("test1", "liayiypioyp");
   cout << gfsClient.read("test1") << endl; 
+
+  GFSClient replicated(4, 3);
+
+  replicated.write("test1", "liayiypioyp");
+  replicated.replica(0).setAlive(false);
+  cout << replicated.read("test1") << endl;
+
+  if (argc > 1 && string(argv[1]) == "bench") {
+    benchmark();
+  }
 }
@@ -41,6 +41,13 @@ getDiedSlaves(42)
 #include <map>
 #include <set>
 #include <string>
+#include <memory>
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <chrono>
+#include <cstdint>
+#include <cmath>
 #include <algorithm>
 #include <iostream>
 #include <iterator>
@@ -48,24 +55,745 @@ getDiedSlaves(42)
 
 using namespace std;
 
+// 128-bit address key. IPv4 addresses are stored IPv4-mapped (::ffff:a.b.c.d)
+// so both families share one table.
+struct IpKey {
+    uint64_t hi;
+    uint64_t lo;
+
+    bool operator==(const IpKey& other) const {
+        return hi == other.hi && lo == other.lo;
+    }
+};
+
+// Parse dotted quad IPv4 without allocating
+bool parseIpv4(const char* s, size_t len, uint32_t& addr) {
+    uint32_t value = 0;
+    int parts = 0;
+    size_t i = 0;
+
+    while (parts < 4) {
+        uint32_t octet = 0;
+        size_t digits = 0;
+
+        while (i < len && s[i] >= '0' && s[i] <= '9' && digits < 3) {
+            octet = octet * 10 + (s[i++] - '0');
+            digits++;
+        }
+
+        if (digits == 0 || octet > 255) {
+            return false;
+        }
+
+        value = value << 8 | octet;
+
+        if (++parts < 4) {
+            if (i >= len || s[i] != '.') {
+                return false;
+            }
+
+            i++;
+        }
+    }
+
+    addr = value;
+
+    return i == len;
+}
+
+// Parse IPv6 hex groups with at most one "::" and an optional dotted IPv4
+// tail, so "::ffff:10.0.0.1" gets the same key as "10.0.0.1"
+bool parseIpv6(const char* s, size_t len, IpKey& key) {
+    uint16_t head[8], tail[8];
+    int headNum = 0, tailNum = 0;
+    bool compressed = false;
+    size_t i = 0;
+
+    if (len >= 2 && s[0] == ':' && s[1] == ':') {
+        compressed = true;
+        i = 2;
+    }
+
+    while (i < len) {
+        uint32_t group = 0;
+        size_t digits = 0;
+        size_t start = i;
+
+        while (i < len && digits < 4) {
+            char c = s[i];
+            int v = c >= '0' && c <= '9' ? c - '0'
+                  : c >= 'a' && c <= 'f' ? c - 'a' + 10
+                  : c >= 'A' && c <= 'F' ? c - 'A' + 10 : -1;
+
+            if (v < 0) {
+                break;
+            }
+
+            group = group << 4 | v;
+            digits++;
+            i++;
+        }
+
+        // The rest is an IPv4 address filling the last two groups
+        if (i < len && s[i] == '.') {
+            uint32_t v4;
+
+            if (headNum + tailNum > 6 || !parseIpv4(s + start, len - start, v4)) {
+                return false;
+            }
+
+            (compressed ? tail[tailNum++] : head[headNum++]) = v4 >> 16;
+            (compressed ? tail[tailNum++] : head[headNum++]) = v4 & 0xffff;
+            break;
+        }
+
+        if (digits == 0 || headNum + tailNum == 8) {
+            return false;
+        }
+
+        (compressed ? tail[tailNum++] : head[headNum++]) = group;
+
+        if (i == len) {
+            break;
+        }
+
+        if (s[i] != ':') {
+            return false;
+        }
+
+        if (i + 1 < len && s[i + 1] == ':') {
+            if (compressed) {
+                return false;
+            }
+
+            compressed = true;
+            i += 2;
+        } else if (++i == len) {
+            return false;
+        }
+    }
+
+    if (compressed ? headNum + tailNum > 7 : headNum != 8) {
+        return false;
+    }
+
+    uint16_t groups[8] = {0};
+
+    copy(head, head + headNum, groups);
+    copy(tail, tail + tailNum, groups + 8 - tailNum);
+
+    key.hi = key.lo = 0;
+
+    for (int g = 0; g < 4; g++) {
+        key.hi = key.hi << 16 | groups[g];
+        key.lo = key.lo << 16 | groups[g + 4];
+    }
+
+    return true;
+}
+
+bool parseIp(const string& ip, IpKey& key) {
+    uint32_t v4;
+
+    if (parseIpv4(ip.data(), ip.size(), v4)) {
+        key.hi = 0;
+        key.lo = 0xffff00000000ULL | v4;
+        return true;
+    }
+
+    return parseIpv6(ip.data(), ip.size(), key);
+}
+
+enum SlaveState { ALIVE, SUSPECT, DEAD };
+
+// State transition of one slave, stamped with the check that observed it
+struct SlaveEvent {
+    int slaveId;
+    SlaveState from;
+    SlaveState to;
+    int timestamp;
+};
+
+// Bounded single-producer single-consumer ring of events. The checker is the
+// only producer; when the consumer falls behind new events are dropped and
+// counted instead of blocking the checker.
+class EventRing {
+public:
+    EventRing(size_t capacity) : head(0), tail(0), dropped(0) {
+        size_t size = 1;
+
+        while (size < capacity) {
+            size <<= 1;
+        }
+
+        events.resize(size);
+        mask = size - 1;
+    }
+
+    bool push(const SlaveEvent& event) {
+        size_t t = tail.load(memory_order_relaxed);
+
+        if (t - head.load(memory_order_acquire) == events.size()) {
+            dropped.fetch_add(1, memory_order_relaxed);
+            return false;
+        }
+
+        events[t & mask] = event;
+        tail.store(t + 1, memory_order_release);
+
+        return true;
+    }
+
+    bool pop(SlaveEvent& event) {
+        size_t h = head.load(memory_order_relaxed);
+
+        if (h == tail.load(memory_order_acquire)) {
+            return false;
+        }
+
+        event = events[h & mask];
+        head.store(h + 1, memory_order_release);
+
+        return true;
+    }
+
+    size_t droppedCount() const {
+        return dropped.load(memory_order_relaxed);
+    }
+
+private:
+    vector<SlaveEvent> events;
+    size_t mask;
+    atomic<size_t> head;
+    atomic<size_t> tail;
+    atomic<size_t> dropped;
+};
+
+// Phi of the accrual failure detector for a batch of slaves. With y the
+// elapsed time since the last ping in standard deviations above the mean
+// inter-arrival time, phi = -log10(1 - F(y)) where F is the logistic
+// approximation of the normal CDF. Rewritten as log10(1 + e) + z / ln(10)
+// it has no branches, so the loop vectorizes (with -O3 -ffast-math GCC maps
+// expf/log10f to the vector math library).
+void computePhiBatch(const float* elapsed, const float* mean, const float* stddev,
+                     float* phi, size_t n) {
+    for (size_t i = 0; i < n; i++) {
+        float y = max((elapsed[i] - mean[i]) / stddev[i], -8.0f);
+        float z = y * (1.5976f + 0.070566f * y * y);
+
+        phi[i] = log10f(1.0f + expf(-z)) + z * 0.4342945f;
+    }
+}
+
+// Slave IPs are interned to dense ids at initialize. ping parses the address
+// straight into an integer key, probes a read-only open addressing table and
+// bumps the slave's last seen timestamp in its own cache line with a CAS, so
+// any number of receiver threads can ping without locks and without hashing
+// the string twice. Addresses that do not parse fall back to a string map,
+// which is also read-only after initialize.
+//
+// Each slave has its own interval k: it becomes SUSPECT after k seconds of
+// silence and DEAD after 2 * k. Liveness is indexed by deadline in a hashed
+// timer wheel: every slave that is not dead sits in the bucket of its next
+// deadline, on an intrusive list threaded through the slots that only the
+// checker touches. check walks the buckets that elapsed since the last
+// check; a slave found there that pinged since it was filed is relinked
+// into the bucket of its new deadline in O(1), the others make ALIVE ->
+// SUSPECT -> DEAD transitions that go into an event ring. A check therefore
+// costs O(transitions + relinks + elapsed buckets), where a slave that keeps
+// pinging is relinked about once per interval. A ping from a suspect or
+// dead slave pushes its id onto a lock-free revival stack so the next check
+// emits the recovery without scanning the dead list.
+//
+// enablePhiAccrual additionally keeps a fixed window of recent inter-arrival
+// times per slave with running sums, so computePhi can report a suspicion
+// level for every slave that adapts to each link's jitter instead of the
+// fixed 2 * k rule. Timestamps may be in any unit as long as k uses the same.
+//
+// Checks are serialized among themselves but never block ping. initialize
+// and enablePhiAccrual must not run concurrently with ping or check.
 class HeartBeat {
 public:
-    HeartBeat() : interval(0) { }
+    HeartBeat(size_t eventCapacity = 1 << 16)
+      : slaveNum(0), mask(0), revived(-1), lastCheck(0), wheelSize(0), wheelShift(0), visited(0), ring(eventCapacity) { }
 
     // @param slavesIpList a list of slaves'ip addresses
     // @param k an integer
     // @return void
     void initialize(vector<string> slavesIpList, int k) {
-        for (string ip : slavesIpList) {
-            slaves[ip] = 0;
+        initialize(slavesIpList, vector<int>(slavesIpList.size(), k));
+    }
+
+    // Per-slave intervals, intervals[i] belongs to slavesIpList[i]
+    void initialize(const vector<string>& slavesIpList, const vector<int>& intervals) {
+        assert(slavesIpList.size() == intervals.size());
+
+        ips.clear();
+        otherIds.clear();
+        states.clear();
+        deadSlaves.clear();
+        deadPos.clear();
+        revived.store(-1);
+
+        // Buckets span a little over the longest wait, 2 * k, at most
+        // MAX_WHEEL_SIZE of them, each covering 2^wheelShift time units
+        long long span = 2LL * max(1, intervals.empty() ? 1 : *max_element(intervals.begin(), intervals.end())) + 1;
+
+        wheelShift = 0;
+
+        while ((span >> wheelShift) >= MAX_WHEEL_SIZE) {
+            wheelShift++;
         }
 
-        interval = k;
+        for (wheelSize = 1; (long long) wheelSize <= span >> wheelShift; wheelSize <<= 1) {
+        }
+
+        wheel.assign(wheelSize, -1);
+        lastCheck = 0;
+
+        size_t capacity = 16;
+
+        while (capacity < 2 * slavesIpList.size()) {
+            capacity <<= 1;
+        }
+
+        mask = capacity - 1;
+        keys.assign(capacity, IpKey{0, 0});
+        keyIds.assign(capacity, -1);
+        slots.reset(new SlaveSlot[slavesIpList.size()]);
+
+        for (size_t i = 0; i < slavesIpList.size(); i++) {
+            const string& ip = slavesIpList[i];
+
+            if (slaveId(ip) >= 0) {
+                continue;
+            }
+
+            int id = ips.size();
+            IpKey key;
+
+            if (parseIp(ip, key)) {
+                size_t pos = hashKey(key) & mask;
+
+                while (keyIds[pos] >= 0) {
+                    pos = (pos + 1) & mask;
+                }
+
+                keys[pos] = key;
+                keyIds[pos] = id;
+            } else {
+                otherIds[ip] = id;
+            }
+
+            SlaveSlot& slot = slots[id];
+
+            slot.lastSeen.store(0, memory_order_relaxed);
+            slot.state.store(ALIVE, memory_order_relaxed);
+            slot.revivePending.store(false, memory_order_relaxed);
+            slot.interval = intervals[i];
+            link(id, intervals[i]);
+
+            ips.push_back(ip);
+            states.push_back(ALIVE);
+            deadPos.push_back(-1);
+        }
+
+        slaveNum = ips.size();
+        windows.reset();
+    }
+
+    // Start sampling inter-arrival times for computePhi
+    void enablePhiAccrual() {
+        windows.reset(new PhiWindow[slaveNum]);
+
+        for (int id = 0; id < slaveNum; id++) {
+            PhiWindow& window = windows[id];
+
+            window.count = window.pos = 0;
+            window.sum = window.sumSq = 0;
+            window.mean.store(slots[id].interval, memory_order_relaxed);
+            window.stddev.store(slots[id].interval / 4.0f, memory_order_relaxed);
+        }
+    }
+
+    // @return dense id of the slave, or -1 if it is not monitored
+    int slaveId(const string& slaveIp) const {
+        IpKey key;
+
+        if (!parseIp(slaveIp, key)) {
+            auto it = otherIds.find(slaveIp);
+            return it == otherIds.end() ? -1 : it->second;
+        }
+
+        if (keyIds.empty()) {
+            return -1;
+        }
+
+        for (size_t pos = hashKey(key) & mask; keyIds[pos] >= 0; pos = (pos + 1) & mask) {
+            if (keys[pos] == key) {
+                return keyIds[pos];
+            }
+        }
+
+        return -1;
+    }
+
+    const string& slaveIp(int id) const {
+        return ips[id];
     }
 
     // @param timestamp current timestamp in seconds
     // @param slaveIp the ip address of the slave server
     // @return nothing
+    void ping(int timestamp, const string& slaveIp) {
+        ping(timestamp, slaveId(slaveIp));
+    }
+
+    // Lock-free ping by interned id
+    void ping(int timestamp, int id) {
+        if (id < 0 || id >= slaveNum) {
+            return;
+        }
+
+        SlaveSlot& slot = slots[id];
+        int prev = slot.lastSeen.load(memory_order_relaxed);
+
+        while (prev < timestamp && !slot.lastSeen.compare_exchange_weak(prev, timestamp)) {
+        }
+
+        if (windows && prev > 0 && prev < timestamp) {
+            addSample(windows[id], timestamp - prev);
+        }
+
+        if (slot.state.load() != ALIVE) {
+            markRevived(id);
+        }
+    }
+
+    // Advance deadlines up to timestamp and emit the resulting events
+    void check(int timestamp) {
+        lock_guard<mutex> lock(checkMutex);
+
+        // Suspect or dead slaves that pinged since the last check
+        for (int id = revived.exchange(-1); id >= 0; ) {
+            int next = slots[id].nextRevived;
+
+            slots[id].revivePending.store(false);
+
+            if (states[id] == DEAD && slots[id].lastSeen.load() + 2 * slots[id].interval > timestamp) {
+                removeDead(id);
+                setState(id, ALIVE, timestamp);
+                link(id, slots[id].lastSeen.load() + slots[id].interval);
+            } else if (states[id] == SUSPECT && slots[id].lastSeen.load() + slots[id].interval > timestamp) {
+                // Filed at its death deadline, which may be past the new one
+                setState(id, ALIVE, timestamp);
+                unlink(id);
+                link(id, slots[id].lastSeen.load() + slots[id].interval);
+            }
+
+            id = next;
+        }
+
+        // Only buckets that elapsed since the last check can hold deadlines
+        // that passed; the last one again, as a revival may have landed there
+        if (timestamp < lastCheck) {
+            return;
+        }
+
+        uint32_t first = (uint32_t) lastCheck >> wheelShift;
+        uint32_t count = min<uint32_t>(((uint32_t) timestamp >> wheelShift) - first + 1, wheelSize);
+
+        for (uint32_t i = 0; i < count; i++) {
+            int& head = wheel[(first + i) & (wheelSize - 1)];
+            int id = head;
+
+            // Detach the bucket first, expire may put slaves back in it
+            head = -1;
+
+            while (id >= 0) {
+                int next = slots[id].next;
+
+                slots[id].bucket = -1;
+                visited++;
+                expire(id, timestamp);
+                id = next;
+            }
+        }
+
+        lastCheck = timestamp;
+    }
+
+    // Pop the next state transition, returns false if none is queued
+    bool nextEvent(SlaveEvent& event) {
+        return ring.pop(event);
+    }
+
+    size_t droppedEvents() const {
+        return ring.droppedCount();
+    }
+
+    // Slots check took out of elapsed buckets so far, read between checks
+    size_t visitedSlots() const {
+        return visited;
+    }
+
+    // Suspicion level of every slave indexed by id, requires enablePhiAccrual
+    void computePhi(int timestamp, vector<float>& phi) {
+        assert(windows);
+
+        lock_guard<mutex> lock(checkMutex);
+
+        phiElapsed.resize(slaveNum);
+        phiMean.resize(slaveNum);
+        phiStddev.resize(slaveNum);
+        phi.resize(slaveNum);
+
+        for (int id = 0; id < slaveNum; id++) {
+            phiElapsed[id] = timestamp - slots[id].lastSeen.load(memory_order_relaxed);
+            phiMean[id] = windows[id].mean.load(memory_order_relaxed);
+            phiStddev[id] = windows[id].stddev.load(memory_order_relaxed);
+        }
+
+        computePhiBatch(phiElapsed.data(), phiMean.data(), phiStddev.data(), phi.data(), slaveNum);
+    }
+
+    // Ids of slaves whose phi reached threshold, e.g. 8 for ~1e-8 false positives
+    vector<int> getSuspectedSlaves(int timestamp, float threshold) {
+        vector<float> phi;
+        vector<int> ret;
+
+        computePhi(timestamp, phi);
+
+        for (int id = 0; id < slaveNum; id++) {
+            if (phi[id] >= threshold) {
+                ret.push_back(id);
+            }
+        }
+
+        return ret;
+    }
+
+    // @param timestamp current timestamp in seconds
+    // @return a list of slaves'ip addresses that died
+    vector<string> getDiedSlaves(int timestamp) {
+        check(timestamp);
+
+        lock_guard<mutex> lock(checkMutex);
+        vector<string> ret;
+
+        ret.reserve(deadSlaves.size());
+
+        for (int id : deadSlaves) {
+            ret.push_back(ips[id]);
+        }
+
+        return ret;
+    }
+
+private:
+    static const uint32_t MAX_WHEEL_SIZE = 1 << 16;
+
+    // One slave per cache line so pings to different slaves never false share
+    struct alignas(64) SlaveSlot {
+        atomic<int> lastSeen;
+        atomic<int> state;
+        atomic<bool> revivePending;
+        int nextRevived;
+        int interval;
+
+        // Wheel position, owned by the checker; bucket is -1 when dead
+        int bucket;
+        int prev;
+        int next;
+    };
+
+    static const int PHI_WINDOW = 8;
+
+    // Last PHI_WINDOW inter-arrival times of one slave with exact running sums
+    struct alignas(64) PhiWindow {
+        atomic_flag lock = ATOMIC_FLAG_INIT;
+        uint8_t count;
+        uint8_t pos;
+        int samples[PHI_WINDOW];
+        int64_t sum;
+        int64_t sumSq;
+        atomic<float> mean;
+        atomic<float> stddev;
+    };
+
+    // Replace the oldest sample and publish the new mean and deviation. The
+    // deviation is floored at a tenth of the mean so a perfectly regular
+    // link does not turn every small delay into a huge phi.
+    static void addSample(PhiWindow& window, int sample) {
+        while (window.lock.test_and_set(memory_order_acquire)) {
+        }
+
+        if (window.count == PHI_WINDOW) {
+            int old = window.samples[window.pos];
+
+            window.sum -= old;
+            window.sumSq -= (int64_t) old * old;
+        } else {
+            window.count++;
+        }
+
+        window.samples[window.pos] = sample;
+        window.pos = (window.pos + 1) % PHI_WINDOW;
+        window.sum += sample;
+        window.sumSq += (int64_t) sample * sample;
+
+        double mean = (double) window.sum / window.count;
+        double variance = max(0.0, (double) window.sumSq / window.count - mean * mean);
+
+        if (window.count >= 2) {
+            window.mean.store(mean, memory_order_relaxed);
+            window.stddev.store(max(sqrt(variance), mean / 10), memory_order_relaxed);
+        }
+
+        window.lock.clear(memory_order_release);
+    }
+
+    static size_t hashKey(const IpKey& key) {
+        uint64_t h = (key.hi ^ key.lo * 0x9e3779b97f4a7c15ULL) * 0xff51afd7ed558ccdULL;
+        return h ^ h >> 32;
+    }
+
+    // Push id onto the revival stack unless it is already there
+    void markRevived(int id) {
+        SlaveSlot& slot = slots[id];
+
+        if (slot.revivePending.exchange(true)) {
+            return;
+        }
+
+        int head = revived.load(memory_order_relaxed);
+
+        do {
+            slot.nextRevived = head;
+        } while (!revived.compare_exchange_weak(head, id));
+    }
+
+    // Put id in the bucket of deadline, or of the last check if that is
+    // later, so a deadline that already passed is seen by the next check
+    void link(int id, int deadline) {
+        SlaveSlot& slot = slots[id];
+        int bucket = ((uint32_t) max(deadline, lastCheck) >> wheelShift) & (wheelSize - 1);
+
+        slot.bucket = bucket;
+        slot.prev = -1;
+        slot.next = wheel[bucket];
+
+        if (slot.next >= 0) {
+            slots[slot.next].prev = id;
+        }
+
+        wheel[bucket] = id;
+    }
+
+    void unlink(int id) {
+        SlaveSlot& slot = slots[id];
+
+        (slot.prev >= 0 ? slots[slot.prev].next : wheel[slot.bucket]) = slot.next;
+
+        if (slot.next >= 0) {
+            slots[slot.next].prev = slot.prev;
+        }
+
+        slot.bucket = -1;
+    }
+
+    // Apply whatever deadline of id passed by timestamp, taken out of the
+    // wheel by the caller, and put it back unless it died
+    void expire(int id, int timestamp) {
+        int lastSeen = slots[id].lastSeen.load();
+        int interval = slots[id].interval;
+
+        if (lastSeen + 2 * interval <= timestamp) {
+            if (states[id] == ALIVE) {
+                setState(id, SUSPECT, timestamp);
+            }
+
+            setState(id, DEAD, timestamp);
+            deadPos[id] = deadSlaves.size();
+            deadSlaves.push_back(id);
+            recheck(id, lastSeen);
+        } else if (lastSeen + interval <= timestamp) {
+            if (states[id] == ALIVE) {
+                setState(id, SUSPECT, timestamp);
+                recheck(id, lastSeen);
+            }
+
+            link(id, lastSeen + 2 * interval);
+        } else {
+            // Pinged since it was filed, or shares the bucket with a later
+            // deadline
+            link(id, lastSeen + interval);
+        }
+    }
+
+    // A ping racing with a transition may have read the old ALIVE state, so
+    // look at the timestamp again after publishing the new state
+    void recheck(int id, int lastSeen) {
+        if (slots[id].lastSeen.load() != lastSeen) {
+            markRevived(id);
+        }
+    }
+
+    void setState(int id, SlaveState to, int timestamp) {
+        ring.push({id, states[id], to, timestamp});
+        states[id] = to;
+        slots[id].state.store(to);
+    }
+
+    void removeDead(int id) {
+        int pos = deadPos[id];
+        int last = deadSlaves.back();
+
+        deadSlaves[pos] = last;
+        deadPos[last] = pos;
+        deadSlaves.pop_back();
+        deadPos[id] = -1;
+    }
+
+    vector<IpKey> keys;
+    vector<int> keyIds;
+    unordered_map<string, int> otherIds;
+    vector<string> ips;
+    unique_ptr<SlaveSlot[]> slots;
+    unique_ptr<PhiWindow[]> windows;
+    int slaveNum;
+    size_t mask;
+    atomic<int> revived;
+
+    // Owned by the checker
+    vector<SlaveState> states;
+    vector<int> deadSlaves;
+    vector<int> deadPos;
+    vector<int> wheel;
+    int lastCheck;
+    uint32_t wheelSize;
+    int wheelShift;
+    size_t visited;
+    EventRing ring;
+    mutex checkMutex;
+    vector<float> phiElapsed;
+    vector<float> phiMean;
+    vector<float> phiStddev;
+};
+
+// Original linear scan, kept as the benchmark baseline
+class ScanHeartBeat {
+public:
+    ScanHeartBeat() : interval(0) { }
+
+    void initialize(vector<string> slavesIpList, int k) {
+        for (string ip : slavesIpList) {
+            slaves[ip] = 0;
+        }
+
+        interval = k;
+    }
+
     void ping(int timestamp, string slaveIp) {
         if (!slaves.count(slaveIp)) {
             return;
@@ -74,8 +802,6 @@ public:
         slaves[slaveIp] = timestamp;
     }
 
-    // @param timestamp current timestamp in seconds
-    // @return a list of slaves'ip addresses that died
     vector<string> getDiedSlaves(int timestamp) {
         vector<string> ret;
         
@@ -98,7 +824,270 @@ void printSlaves(vector<string>& s) {
 	cout << endl;
 }
 
-int main() {
+vector<string> makeIps(int n) {
+    vector<string> ips;
+
+    for (int i = 0; i < n; i++) {
+        ips.push_back("10." + to_string(i >> 16 & 255) + "." + to_string(i >> 8 & 255) + "." + to_string(i & 255));
+    }
+
+    return ips;
+}
+
+// Every slave pings once per second of simulated time and a check runs after
+// each second, so nobody dies and the scan pays for n entries per check
+template <class Monitor>
+void benchmarkMonitor(const char* name, int n) {
+    const int k = 10, seconds = 30;
+    vector<string> ips = makeIps(n);
+    Monitor monitor;
+    double pingSecs = 0, checkSecs = 0;
+
+    monitor.initialize(ips, k);
+
+    for (int t = 1; t <= seconds; t++) {
+        auto start = chrono::steady_clock::now();
+
+        for (int i = 0; i < n; i++) {
+            monitor.ping(t, ips[i]);
+        }
+
+        auto mid = chrono::steady_clock::now();
+        auto dead = monitor.getDiedSlaves(t);
+        auto end = chrono::steady_clock::now();
+
+        assert(dead.empty());
+
+        pingSecs += chrono::duration<double>(mid - start).count();
+        checkSecs += chrono::duration<double>(end - mid).count();
+    }
+
+    cout << name << " n=" << n
+         << " ping " << (n * (double) seconds / pingSecs / 1e6) << " M/s"
+         << " check " << (checkSecs / seconds * 1e6) << " us" << endl;
+}
+
+// Receiver threads ping disjoint slices of 100K slaves by IP string while a
+// checker thread keeps calling getDiedSlaves
+void benchmarkConcurrentPing() {
+    const int n = 100000, rounds = 20;
+    vector<string> ips = makeIps(n);
+    HeartBeat monitor;
+
+    monitor.initialize(ips, 10);
+
+    for (int threads = 1; threads <= 64; threads *= 2) {
+        atomic<bool> done(false);
+        vector<thread> workers;
+
+        thread checker([&] {
+            while (!done.load()) {
+                monitor.getDiedSlaves(rounds);
+            }
+        });
+
+        auto start = chrono::steady_clock::now();
+
+        for (int t = 0; t < threads; t++) {
+            workers.emplace_back([&, t] {
+                for (int r = 1; r <= rounds; r++) {
+                    for (int i = t; i < n; i += threads) {
+                        monitor.ping(r, ips[i]);
+                    }
+                }
+            });
+        }
+
+        for (auto& worker : workers) {
+            worker.join();
+        }
+
+        double secs = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+        done = true;
+        checker.join();
+
+        cout << "threads=" << threads << " ping " << (n * (double) rounds / secs / 1e6) << " M/s" << endl;
+    }
+}
+
+// 1M slaves ping every second; each second 0.01% of them go silent and the
+// ones that went silent earlier come back. Reports the cost of a check and the
+// time from the start of a check until its events have been consumed.
+// Returns the check time per event in microseconds
+double benchmarkEvents(int churn) {
+    const int n = 1000000, k = 10, seconds = 60;
+    vector<string> ips = makeIps(n);
+    vector<int> silentUntil(n, 0);
+    HeartBeat monitor;
+    double checkSecs = 0, latencySecs = 0;
+    long long events = 0;
+
+    monitor.initialize(ips, k);
+
+    for (int t = 1; t <= seconds; t++) {
+        for (int c = 0; c < churn; c++) {
+            silentUntil[(t * 7919LL + c * 104729LL) % n] = t + 3 * k;
+        }
+
+        for (int i = 0; i < n; i++) {
+            if (silentUntil[i] <= t) {
+                monitor.ping(t, i);
+            }
+        }
+
+        auto start = chrono::steady_clock::now();
+        monitor.check(t);
+        auto mid = chrono::steady_clock::now();
+
+        SlaveEvent event;
+
+        while (monitor.nextEvent(event)) {
+            events++;
+        }
+
+        auto end = chrono::steady_clock::now();
+
+        checkSecs += chrono::duration<double>(mid - start).count();
+        latencySecs += chrono::duration<double>(end - start).count();
+    }
+
+    cout << "events n=" << n << " churn=" << churn << " check " << (checkSecs / seconds * 1e6) << " us"
+         << " latency " << (latencySecs / seconds * 1e6) << " us"
+         << " events/check " << (events / seconds)
+         << " visited/check " << (monitor.visitedSlots() / seconds)
+         << " dropped " << monitor.droppedEvents() << endl;
+
+    return checkSecs * 1e6 / max(1LL, events);
+}
+
+// Simulated cluster with timestamps in milliseconds and k = 1000. Half the
+// slaves sit on quiet links (1000 +- 20 ms between pings), half on jittery
+// links (300 to 2300 ms), and 20% of all slaves die at a random time. Both
+// detectors are evaluated every 100 ms: the fixed 2 * k rule through check()
+// events and phi >= 8 through computePhi.
+void benchmarkPhi() {
+    const int n = 10000, k = 1000, duration = 120000, step = 100;
+    const float threshold = 8;
+    vector<string> ips = makeIps(n);
+    vector<int> deathTime(n, INT32_MAX);
+    vector<vector<int>> pingsAt(duration / step + 1);
+    unsigned seed = 12345;
+    auto rnd = [&seed](int range) {
+        seed = seed * 1103515245 + 12345;
+        return (int) ((seed >> 8) % range);
+    };
+
+    for (int i = 0; i < n; i++) {
+        if (rnd(5) == 0) {
+            deathTime[i] = 30000 + rnd(duration - 40000);
+        }
+
+        bool jittery = i % 2;
+
+        for (int t = rnd(k); t < min(duration, deathTime[i]); t += jittery ? 300 + rnd(2000) : 980 + rnd(40)) {
+            pingsAt[t / step].push_back(i);
+        }
+    }
+
+    HeartBeat fixed, phiMonitor;
+    vector<float> phi;
+    vector<bool> flagged(n, false), detected(n, false);
+    long long pings = 0, fixedFalse = 0, phiFalse = 0;
+    double fixedLatency[2] = {0, 0}, phiLatency[2] = {0, 0};
+    int fixedFound[2] = {0, 0}, phiFound[2] = {0, 0};
+    double fixedSecs = 0, phiSecs = 0;
+
+    fixed.initialize(ips, k);
+    phiMonitor.initialize(ips, k);
+    phiMonitor.enablePhiAccrual();
+
+    for (int tick = 1; tick <= duration / step; tick++) {
+        int t = tick * step;
+        auto start = chrono::steady_clock::now();
+
+        for (int id : pingsAt[tick - 1]) {
+            fixed.ping(t, id);
+        }
+
+        fixed.check(t);
+
+        auto mid = chrono::steady_clock::now();
+
+        for (int id : pingsAt[tick - 1]) {
+            phiMonitor.ping(t, id);
+        }
+
+        phiMonitor.computePhi(t, phi);
+
+        auto end = chrono::steady_clock::now();
+
+        fixedSecs += chrono::duration<double>(mid - start).count();
+        phiSecs += chrono::duration<double>(end - mid).count();
+        pings += pingsAt[tick - 1].size();
+
+        SlaveEvent event;
+
+        while (fixed.nextEvent(event)) {
+            int id = event.slaveId;
+
+            if (event.to != DEAD) {
+                continue;
+            }
+
+            if (t < deathTime[id]) {
+                fixedFalse++;
+            } else if (!detected[id]) {
+                detected[id] = true;
+                fixedLatency[id % 2] += t - deathTime[id];
+                fixedFound[id % 2]++;
+            }
+        }
+
+        for (int id = 0; id < n; id++) {
+            bool suspected = phi[id] >= threshold;
+
+            if (suspected && !flagged[id]) {
+                if (t < deathTime[id]) {
+                    phiFalse++;
+                } else {
+                    phiLatency[id % 2] += t - deathTime[id];
+                    phiFound[id % 2]++;
+                }
+            }
+
+            flagged[id] = suspected;
+        }
+    }
+
+    cout << "fixed 2k  false alarms " << fixedFalse
+         << " latency quiet " << fixedLatency[0] / max(1, fixedFound[0]) << " ms"
+         << " jittery " << fixedLatency[1] / max(1, fixedFound[1]) << " ms"
+         << " cpu " << (fixedSecs / pings * 1e6 * 1e3) << " ms/1M pings" << endl;
+    cout << "phi >= 8  false alarms " << phiFalse
+         << " latency quiet " << phiLatency[0] / max(1, phiFound[0]) << " ms"
+         << " jittery " << phiLatency[1] / max(1, phiFound[1]) << " ms"
+         << " cpu " << (phiSecs / pings * 1e6 * 1e3) << " ms/1M pings" << endl;
+}
+
+void benchmark() {
+    for (int n : {10000, 100000, 1000000}) {
+        benchmarkMonitor<ScanHeartBeat>("scan    ", n);
+        benchmarkMonitor<HeartBeat>("wheel   ", n);
+    }
+
+    benchmarkConcurrentPing();
+
+    // 10x the churn over the same slaves: if check cost tracks events and
+    // not n, the cost per event stays flat instead of dropping 10x
+    double low = benchmarkEvents(100);
+    double high = benchmarkEvents(1000);
+    cout << "check per event churn=100 " << low << " us churn=1000 " << high << " us"
+         << (low < 3 * high ? " ok" : " SCALES WITH N") << endl;
+    benchmarkPhi();
+}
+
+int main(int argc, char* argv[]) {
 	HeartBeat heatBest;
 
 	heatBest.initialize({"10.173.0.2", "10.173.0.3"}, 10);
@@ -111,9 +1100,31 @@ int main() {
 	printSlaves(slaves);
 	heatBest.ping(22, "10.173.0.2");
 	heatBest.ping(23, "10.173.0.3");
-	heatBest.getDiedSlaves(24);
+	slaves = heatBest.getDiedSlaves(24);
 	printSlaves(slaves);
-	heatBest.getDiedSlaves(42);
+	slaves = heatBest.getDiedSlaves(42);
+	printSlaves(slaves);
+
+	SlaveEvent event;
+	const char* stateNames[] = {"alive", "suspect", "dead"};
+
+	while (heatBest.nextEvent(event)) {
+		cout << event.timestamp << " " << heatBest.slaveIp(event.slaveId) << " "
+		     << stateNames[event.from] << " -> " << stateNames[event.to] << endl;
+	}
+
+	HeartBeat ipv6;
+
+	ipv6.initialize({"2001:db8::1", "::ffff:10.0.0.1", "10.0.0.2"}, 10);
+	assert(ipv6.slaveId("::ffff:10.0.0.1") == ipv6.slaveId("10.0.0.1"));
+	assert(ipv6.slaveId("0:0:0:0:0:FFFF:10.0.0.2") == ipv6.slaveId("10.0.0.2"));
+	assert(ipv6.slaveId("::ffff:10.0.0.2:1") < 0);
+	ipv6.ping(15, "2001:0DB8:0:0:0:0:0:1");
+	ipv6.ping(15, "10.0.0.1");
+	slaves = ipv6.getDiedSlaves(20);
 	printSlaves(slaves);
 
+	if (argc > 1 && string(argv[1]) == "bench") {
+		benchmark();
+	}
 }
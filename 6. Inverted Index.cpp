@@ -34,38 +34,2651 @@ Return an inverted index (HashMap with key is the word and value is a list of do
 #include <map>
 #include <set>
 #include <string>
+#include <string_view>
+#include <queue>
+#include <tuple>
+#include <optional>
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <cmath>
+#include <climits>
 #include <algorithm>
 #include <iostream>
+#include <fstream>
 #include <iterator>
 #include <sstream> 
 #include <cassert>
 
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#ifdef __SSSE3__
+#include <tmmintrin.h>
+#endif
+
 using namespace std;
 
-class InvertedIndex {
+// StreamVByte: a group of four 32-bit values is described by one control
+// byte holding four 2-bit byte lengths, and the value bytes are stored
+// separately, so a group is decoded with a single byte shuffle.
+const size_t POSTING_BLOCK = 128;
+
+// Bytes of slack after encoded data so the SIMD decoder may over-read
+const size_t STREAMVBYTE_PADDING = 16;
+
+inline int byteLength(uint32_t value) {
+  return value < (1u << 8) ? 1 : value < (1u << 16) ? 2 : value < (1u << 24) ? 3 : 4;
+}
+
+// Encode n values as control bytes followed by data bytes, returns bytes written
+size_t encodeStreamVByte(const uint32_t* in, size_t n, uint8_t* out) {
+  uint8_t* control = out;
+  uint8_t* data = out + (n + 3) / 4;
+
+  memset(control, 0, (n + 3) / 4);
+
+  for (size_t i = 0; i < n; i++) {
+    int length = byteLength(in[i]);
+
+    control[i / 4] |= (length - 1) << (2 * (i % 4));
+    memcpy(data, &in[i], length);
+    data += length;
+  }
+
+  return data - out;
+}
+
+size_t maxStreamVByteSize(size_t n) {
+  return (n + 3) / 4 + 4 * n;
+}
+
+#ifdef __SSSE3__
+struct StreamVByteTables {
+  uint8_t shuffle[256][16];
+  uint8_t length[256];
+
+  StreamVByteTables() {
+    for (int control = 0; control < 256; control++) {
+      int pos = 0;
+
+      for (int i = 0; i < 4; i++) {
+        int length = (control >> (2 * i) & 3) + 1;
+
+        for (int b = 0; b < 4; b++) {
+          shuffle[control][4 * i + b] = b < length ? pos + b : 0x80;
+        }
+
+        pos += length;
+      }
+
+      this->length[control] = pos;
+    }
+  }
+};
+
+const StreamVByteTables streamVByteTables;
+#endif
+
+// Decode n values written by encodeStreamVByte, out must have room for n
+// rounded up to a multiple of four
+void decodeStreamVByte(const uint8_t* in, size_t n, uint32_t* out) {
+  const uint8_t* control = in;
+  const uint8_t* data = in + (n + 3) / 4;
+  size_t i = 0;
+
+#ifdef __SSSE3__
+  for (; i + 4 <= n; i += 4) {
+    uint8_t c = control[i / 4];
+    __m128i bytes = _mm_loadu_si128((const __m128i*) data);
+    __m128i shuffle = _mm_loadu_si128((const __m128i*) streamVByteTables.shuffle[c]);
+
+    _mm_storeu_si128((__m128i*) (out + i), _mm_shuffle_epi8(bytes, shuffle));
+    data += streamVByteTables.length[c];
+  }
+#endif
+
+  for (; i < n; i++) {
+    int length = (control[i / 4] >> (2 * (i % 4)) & 3) + 1;
+
+    out[i] = 0;
+    memcpy(&out[i], data, length);
+    data += length;
+  }
+}
+
+// Skip pointer of one block: its last doc id, where its doc ids, term
+// frequencies and positions start, and the best BM25 score in the block
+struct BlockSkip {
+  int lastDoc;
+  uint32_t offset;
+  uint32_t freqOffset;
+  uint32_t posOffset;
+  float maxScore;
+};
+
+const float BM25_K1 = 1.2f;
+const float BM25_B = 0.75f;
+
+// BM25 inverse document frequency of a term found in df of docs docs
+inline float bm25Idf(size_t docs, size_t df) {
+  return log(1.0 + (docs - df + 0.5) / (df + 0.5));
+}
+
+// BM25 contribution of a term with weight idf occurring freq times
+inline float bm25TermScore(float idf, uint32_t freq, uint32_t length, float avgDocLength) {
+  float norm = BM25_K1 * (1 - BM25_B + BM25_B * length / avgDocLength);
+  return idf * freq * (BM25_K1 + 1) / (freq + norm);
+}
+
+// Doc ids of one term with the positions it occurs at in each doc.
+// positions is the concatenation of every doc's positions, freqs[i] long.
+struct Occurrences {
+  vector<int> docs;
+  vector<uint32_t> freqs;
+  vector<uint32_t> positions;
+
+  void add(int doc, uint32_t position) {
+    if (docs.empty() || docs.back() != doc) {
+      docs.push_back(doc);
+      freqs.push_back(0);
+    }
+
+    freqs.back()++;
+    positions.push_back(position);
+  }
+
+  void append(const Occurrences& other) {
+    docs.insert(docs.end(), other.docs.begin(), other.docs.end());
+    freqs.insert(freqs.end(), other.freqs.begin(), other.freqs.end());
+    positions.insert(positions.end(), other.positions.begin(), other.positions.end());
+  }
+
+  void clear() {
+    docs.clear();
+    freqs.clear();
+    positions.clear();
+  }
+};
+
+// Read-only view of one term's postings. Doc ids are kept in blocks of
+// POSTING_BLOCK, delta encoded against the previous doc and StreamVByte
+// packed, followed by the block's term frequencies and its positions, delta
+// encoded within each doc. The skip table lets a reader jump to the block
+// that may hold a target doc without decoding the blocks before it.
+class PostingList {
+public:
+  PostingList() : data(nullptr), skips(nullptr), count(0), bestScore(0) { }
+
+  PostingList(const uint8_t* data, const BlockSkip* skips, size_t count, float bestScore = 0)
+    : data(data), skips(skips), count(count), bestScore(bestScore) { }
+
+  size_t size() const {
+    return count;
+  }
+
+  // Upper bound of the term's BM25 score in any doc
+  float maxScore() const {
+    return bestScore;
+  }
+
+  size_t blockCount() const {
+    return (count + POSTING_BLOCK - 1) / POSTING_BLOCK;
+  }
+
+  size_t blockSize(size_t block) const {
+    return min(POSTING_BLOCK, count - block * POSTING_BLOCK);
+  }
+
+  const BlockSkip& skip(size_t block) const {
+    return skips[block];
+  }
+
+  // Decode doc ids of a block into out, returns how many there are
+  size_t decodeBlock(size_t block, int* out) const {
+    size_t n = blockSize(block);
+    uint32_t prev = block == 0 ? 0 : skips[block - 1].lastDoc;
+    uint32_t* deltas = reinterpret_cast<uint32_t*>(out);
+
+    decodeStreamVByte(data + skips[block].offset, n, deltas);
+
+    for (size_t i = 0; i < n; i++) {
+      prev += deltas[i];
+      out[i] = prev;
+    }
+
+    return n;
+  }
+
+  // Decode term frequencies of a block, returns their sum
+  size_t decodeFreqs(size_t block, uint32_t* out) const {
+    size_t n = blockSize(block);
+    size_t total = 0;
+
+    decodeStreamVByte(data + skips[block].freqOffset, n, out);
+
+    for (size_t i = 0; i < n; i++) {
+      total += out[i];
+    }
+
+    return total;
+  }
+
+  // Decode the positions of a block given its frequencies; out needs room
+  // for their sum rounded up to a multiple of four
+  void decodePositions(size_t block, const uint32_t* freqs, size_t total, uint32_t* out) const {
+    decodeStreamVByte(data + skips[block].posOffset, total, out);
+
+    for (size_t i = 0, p = 0; i < blockSize(block); i++) {
+      for (uint32_t j = 1; j < freqs[i]; j++) {
+        out[p + j] += out[p + j - 1];
+      }
+
+      p += freqs[i];
+    }
+  }
+
+  vector<int> toVector() const {
+    vector<int> docs(blockCount() * POSTING_BLOCK);
+
+    for (size_t b = 0; b < blockCount(); b++) {
+      decodeBlock(b, &docs[b * POSTING_BLOCK]);
+    }
+
+    docs.resize(count);
+
+    return docs;
+  }
+
+  // Cursor over the doc ids, defined below
+  class Iterator;
+
+private:
+  friend class InvertedIndex;
+
+  const uint8_t* data;
+  const BlockSkip* skips;
+  size_t count;
+  float bestScore;
+};
+
+// Forward cursor over the doc ids, doc() is END once exhausted. Term
+// frequencies and positions are only decoded when asked for. It keeps its
+// own copy of the view, so the list it was made from may go away.
+class PostingList::Iterator {
+public:
+  static const int END = INT_MAX;
+
+  Iterator(const PostingList& list) : list(list), block(0), pos(0), n(0) {
+    load(0);
+  }
+
+  int doc() const {
+    return pos < n ? docs[pos] : END;
+  }
+
+  void next() {
+    if (++pos == n) {
+      load(block + 1);
+    }
+  }
+
+  // Move to the first doc >= target
+  void advance(int target) {
+    if (pos < n && docs[n - 1] >= target) {
+      pos = lower_bound(docs + pos, docs + n, target) - docs;
+      return;
+    }
+
+    if (block >= list.blockCount()) {
+      return;
+    }
+
+    load(findBlock(target));
+
+    if (pos < n) {
+      pos = lower_bound(docs, docs + n, target) - docs;
+    }
+  }
+
+  // First block from the current one whose last doc is >= target, or
+  // blockCount() if there is none; nothing is decoded
+  size_t findBlock(int target) const {
+    size_t blocks = list.blockCount();
+
+    if (block >= blocks || list.skip(block).lastDoc >= target) {
+      return block;
+    }
+
+    // Gallop over skip pointers, then binary search the last gap
+    size_t lo = block + 1, hi = lo, step = 1;
+
+    while (hi < blocks && list.skip(hi).lastDoc < target) {
+      lo = hi + 1;
+      hi += step;
+      step *= 2;
+    }
+
+    hi = min(hi, blocks);
+
+    while (lo < hi) {
+      size_t mid = (lo + hi) / 2;
+
+      if (list.skip(mid).lastDoc < target) {
+        lo = mid + 1;
+      } else {
+        hi = mid;
+      }
+    }
+
+    return lo;
+  }
+
+  // Occurrences of the term in the current doc
+  uint32_t freq() {
+    loadFreqs();
+    return freqs[pos];
+  }
+
+  // Sorted positions of the term in the current doc, freq() of them
+  const uint32_t* positions() {
+    loadFreqs();
+
+    if (!positionsLoaded) {
+      positionBuffer.resize((freqTotal + 3) / 4 * 4);
+      list.decodePositions(block, freqs, freqTotal, positionBuffer.data());
+
+      for (size_t i = 0; i < n; i++) {
+        positionStart[i + 1] = positionStart[i] + freqs[i];
+      }
+
+      positionsLoaded = true;
+    }
+
+    return positionBuffer.data() + positionStart[pos];
+  }
+
+private:
+  void load(size_t b) {
+    block = b;
+    pos = 0;
+    n = b < list.blockCount() ? list.decodeBlock(b, docs) : 0;
+    freqsLoaded = positionsLoaded = false;
+  }
+
+  void loadFreqs() {
+    if (!freqsLoaded) {
+      freqTotal = list.decodeFreqs(block, freqs);
+      freqsLoaded = true;
+    }
+  }
+
+  PostingList list;
+  size_t block;
+  size_t pos;
+  size_t n;
+  int docs[POSTING_BLOCK];
+  bool freqsLoaded;
+  bool positionsLoaded;
+  size_t freqTotal;
+  uint32_t freqs[POSTING_BLOCK];
+  uint32_t positionStart[POSTING_BLOCK + 1] = {0};
+  vector<uint32_t> positionBuffer;
+};
+
+// Append StreamVByte encoded values to the arena, returns where they start
+size_t appendStreamVByte(const uint32_t* values, size_t n, vector<uint8_t>& bytes) {
+  size_t offset = bytes.size();
+
+  bytes.resize(offset + maxStreamVByteSize(n));
+  bytes.resize(offset + encodeStreamVByte(values, n, &bytes[offset]));
+
+  return offset;
+}
+
+// Append one term's occurrences, sorted by doc id, to the posting arena;
+// skip offsets are relative to the first byte of the list
+void encodePostings(const Occurrences& occurrences, vector<uint8_t>& bytes, vector<BlockSkip>& skips) {
+  const vector<int>& docs = occurrences.docs;
+  uint32_t deltas[POSTING_BLOCK];
+  vector<uint32_t> positions;
+  uint32_t prev = 0;
+  size_t start = bytes.size();
+  size_t p = 0;
+
+  for (size_t b = 0; b < docs.size(); b += POSTING_BLOCK) {
+    size_t n = min(POSTING_BLOCK, docs.size() - b);
+
+    positions.clear();
+
+    for (size_t i = 0; i < n; i++) {
+      uint32_t freq = occurrences.freqs[b + i];
+
+      deltas[i] = (uint32_t) docs[b + i] - prev;
+      prev = docs[b + i];
+
+      for (uint32_t j = 0; j < freq; j++, p++) {
+        positions.push_back(j == 0 ? occurrences.positions[p]
+                                   : occurrences.positions[p] - occurrences.positions[p - 1]);
+      }
+    }
+
+    BlockSkip skip;
+
+    skip.lastDoc = docs[b + n - 1];
+    skip.offset = appendStreamVByte(deltas, n, bytes) - start;
+    skip.freqOffset = appendStreamVByte(&occurrences.freqs[b], n, bytes) - start;
+    skip.posOffset = appendStreamVByte(positions.data(), positions.size(), bytes) - start;
+    skips.push_back(skip);
+  }
+}
+
+// Hash of a token, eight bytes at a time
+inline size_t hashToken(string_view token) {
+  const char* p = token.data();
+  size_t n = token.size();
+  uint64_t h = 0x9e3779b97f4a7c15ULL ^ n;
+  size_t i = 0;
+
+  for (; i + 8 <= n; i += 8) {
+    uint64_t word;
+
+    memcpy(&word, p + i, 8);
+    h = (h ^ word) * 0xff51afd7ed558ccdULL;
+    h ^= h >> 32;
+  }
+
+  uint64_t tail = 0;
+
+  memcpy(&tail, p + i, n - i);
+  h = (h ^ tail) * 0xc4ceb9fe1a85ec53ULL;
+
+  return h ^ h >> 29;
+}
+
+// Letters, digits and any byte of a multi-byte UTF-8 sequence form words;
+// everything else is whitespace or punctuation
+inline bool isWordByte(unsigned char c) {
+  return (unsigned) ((c | 0x20) - 'a') < 26 || (unsigned) (c - '0') < 10 || c >= 0x80;
+}
+
+// Splits a buffer into words without allocating. Tokens are views into the
+// buffer, or with case folding into an internal buffer that is reused and
+// only valid until the next call. Word boundaries are found 16 bytes at a
+// time with SSE2 character class masks.
+class Tokenizer {
+public:
+  Tokenizer(string_view text, bool foldCase = false) : text(text), pos(0), foldCase(foldCase) { }
+
+  // Next token and its hashToken, false once the buffer is exhausted
+  bool next(string_view& token, size_t& hash) {
+    size_t start = scan(pos, false);
+
+    if (start == text.size()) {
+      pos = start;
+      return false;
+    }
+
+    pos = scan(start, true);
+    token = text.substr(start, pos - start);
+
+    if (foldCase) {
+      folded.assign(token.begin(), token.end());
+
+      for (char& c: folded) {
+        if (c >= 'A' && c <= 'Z') {
+          c += 'a' - 'A';
+        }
+      }
+
+      token = folded;
+    }
+
+    hash = hashToken(token);
+
+    return true;
+  }
+
+private:
+#ifdef __SSE2__
+  // Bit i set when byte i of the 16 at p is a word byte
+  static unsigned wordMask(const char* p) {
+    __m128i c = _mm_loadu_si128((const __m128i*) p);
+    __m128i alpha = _mm_sub_epi8(_mm_or_si128(c, _mm_set1_epi8(0x20)), _mm_set1_epi8('a'));
+    __m128i digit = _mm_sub_epi8(c, _mm_set1_epi8('0'));
+    __m128i isAlpha = _mm_cmpeq_epi8(_mm_min_epu8(alpha, _mm_set1_epi8(25)), alpha);
+    __m128i isDigit = _mm_cmpeq_epi8(_mm_min_epu8(digit, _mm_set1_epi8(9)), digit);
+    __m128i isHigh = _mm_cmplt_epi8(c, _mm_setzero_si128());
+
+    return _mm_movemask_epi8(_mm_or_si128(_mm_or_si128(isAlpha, isDigit), isHigh));
+  }
+#endif
+
+  // First index from `from` on whose byte is a word byte (inWord false) or
+  // is not one (inWord true)
+  size_t scan(size_t from, bool inWord) const {
+#ifdef __SSE2__
+    while (from + 16 <= text.size()) {
+      unsigned mask = wordMask(text.data() + from);
+
+      if (inWord) {
+        mask = ~mask & 0xffff;
+      }
+
+      if (mask) {
+        return from + __builtin_ctz(mask);
+      }
+
+      from += 16;
+    }
+#endif
+
+    while (from < text.size() && isWordByte(text[from]) == inWord) {
+      from++;
+    }
+
+    return from;
+  }
+
+  string_view text;
+  size_t pos;
+  bool foldCase;
+  string folded;
+};
+
+// Where one term's postings live inside an encoded arena
+struct TermPostings {
+  string word;
+  size_t byteStart;
+  size_t skipStart;
+  size_t count;
+};
+
+class InvertedIndex {
+public:
+  InvertedIndex(unordered_map<int, string>& documents);
+
+  // Take ownership of an encoded arena, as produced by InvertedIndexBuilder,
+  // and the token count of every doc. Block max scores are filled in here
+  // since they depend on collection statistics.
+  InvertedIndex(vector<uint8_t>&& bytes, vector<BlockSkip>&& skips, const vector<TermPostings>& terms,
+                unordered_map<int, uint32_t>&& docLengths)
+    : bytes(move(bytes)), skips(move(skips)), docLengths(move(docLengths)), avgDocLength(1) {
+    this->bytes.resize(this->bytes.size() + STREAMVBYTE_PADDING);
+    wordToPostings.reserve(terms.size());
+
+    if (!this->docLengths.empty()) {
+      double total = 0;
+
+      for (auto& entry: this->docLengths) {
+        total += entry.second;
+      }
+
+      avgDocLength = max(1.0, total / this->docLengths.size());
+    }
+
+    int docs[POSTING_BLOCK];
+    uint32_t freqs[POSTING_BLOCK];
+
+    for (const TermPostings& term: terms) {
+      PostingList list(&this->bytes[term.byteStart], &this->skips[term.skipStart], term.count);
+      float weight = idf(term.count);
+      float best = 0;
+
+      for (size_t b = 0; b < list.blockCount(); b++) {
+        size_t n = list.decodeBlock(b, docs);
+        float blockBest = 0;
+
+        list.decodeFreqs(b, freqs);
+
+        for (size_t i = 0; i < n; i++) {
+          blockBest = max(blockBest, termScore(weight, freqs[i], docLength(docs[i])));
+        }
+
+        this->skips[term.skipStart + b].maxScore = blockBest;
+        best = max(best, blockBest);
+      }
+
+      wordToPostings[term.word] =
+        PostingList(&this->bytes[term.byteStart], &this->skips[term.skipStart], term.count, best);
+    }
+  }
+
+  InvertedIndex(const InvertedIndex&) = delete;
+  InvertedIndex(InvertedIndex&&) = default;
+
+  // Read-only term -> posting list view
+  const unordered_map<string, PostingList>& getInvertedIndexMap() const {
+    return wordToPostings;
+  }
+
+  // Postings of word, or nullptr if it does not occur
+  const PostingList* find(const string& word) const {
+    auto it = wordToPostings.find(word);
+    return it == wordToPostings.end() ? nullptr : &it->second;
+  }
+
+  // Bytes held by encoded postings and skip tables
+  size_t postingBytes() const {
+    return bytes.size() + skips.size() * sizeof(BlockSkip);
+  }
+
+  const unordered_map<int, uint32_t>& getDocLengths() const {
+    return docLengths;
+  }
+
+  uint32_t docLength(int doc) const {
+    auto it = docLengths.find(doc);
+    return it == docLengths.end() ? 0 : it->second;
+  }
+
+  // BM25 inverse document frequency of a term found in df docs
+  float idf(size_t df) const {
+    return bm25Idf(docLengths.size(), df);
+  }
+
+  // BM25 contribution of a term with weight idf occurring freq times
+  float termScore(float idf, uint32_t freq, uint32_t length) const {
+    return bm25TermScore(idf, freq, length, avgDocLength);
+  }
+
+  // Write the index to a file MappedIndex can open, false on I/O error
+  bool save(const string& path) const;
+
+private:
+  vector<uint8_t> bytes;
+  vector<BlockSkip> skips;
+  unordered_map<string, PostingList> wordToPostings;
+  unordered_map<int, uint32_t> docLengths;
+  float avgDocLength;
+};
+
+// Bump allocator for term bytes, released all at once with the arena
+class Arena {
+public:
+  Arena() : used(0), capacity(0) { }
+
+  string_view copy(string_view s) {
+    if (used + s.size() > capacity) {
+      capacity = max(CHUNK_SIZE, s.size());
+      chunks.emplace_back(new char[capacity]);
+      used = 0;
+    }
+
+    char* p = chunks.back().get() + used;
+
+    memcpy(p, s.data(), s.size());
+    used += s.size();
+
+    return string_view(p, s.size());
+  }
+
+private:
+  static constexpr size_t CHUNK_SIZE = 1 << 16;
+
+  vector<unique_ptr<char[]>> chunks;
+  size_t used;
+  size_t capacity;
+};
+
+// Open addressing term -> id table whose keys live in an arena, with the
+// occurrences of each term collected alongside
+class TermDictionary {
+public:
+  TermDictionary() : slots(1024, -1), mask(1023) { }
+
+  // Id of term, inserting it with no occurrences if it is new
+  int intern(string_view term, size_t hash) {
+    for (size_t pos = hash & mask; ; pos = (pos + 1) & mask) {
+      int id = slots[pos];
+
+      if (id < 0) {
+        id = terms.size();
+        slots[pos] = id;
+        terms.push_back(arena.copy(term));
+        hashes.push_back(hash);
+        occurrences.emplace_back();
+
+        if (terms.size() * 2 > slots.size()) {
+          grow();
+        }
+
+        return id;
+      }
+
+      if (hashes[id] == hash && terms[id] == term) {
+        return id;
+      }
+    }
+  }
+
+  vector<string_view> terms;
+  vector<size_t> hashes;
+  vector<Occurrences> occurrences;
+
+private:
+  void grow() {
+    slots.assign(slots.size() * 2, -1);
+    mask = slots.size() - 1;
+
+    for (size_t id = 0; id < terms.size(); id++) {
+      size_t pos = hashes[id] & mask;
+
+      while (slots[pos] >= 0) {
+        pos = (pos + 1) & mask;
+      }
+
+      slots[pos] = id;
+    }
+  }
+
+  Arena arena;
+  vector<int> slots;
+  size_t mask;
+};
+
+// Builds an InvertedIndex on several threads. Documents are sorted by id and
+// split into contiguous ranges, one per worker, so every worker produces a
+// segment whose doc lists are sorted and whose ids all precede the next
+// segment's. Each segment's terms are bucketed by hash into one partition per
+// worker and sorted; worker p then k-way merges partition p of all segments,
+// concatenating doc lists in segment order, and encodes the result. The
+// partition arenas are finally stitched into one.
+class InvertedIndexBuilder {
+public:
+  InvertedIndexBuilder(int threads = thread::hardware_concurrency(), bool foldCase = false)
+    : threads(max(1, threads)), foldCase(foldCase) { }
+
+  InvertedIndex build(const unordered_map<int, string>& documents) const {
+    vector<pair<int, const string*>> docs;
+
+    docs.reserve(documents.size());
+
+    for (auto& document: documents) {
+      docs.push_back({document.first, &document.second});
+    }
+
+    sort(docs.begin(), docs.end());
+
+    int workers = threads;
+    vector<TermDictionary> segments(workers);
+    vector<vector<vector<int>>> partitions(workers, vector<vector<int>>(workers));
+    vector<vector<pair<int, uint32_t>>> lengths(workers);
+
+    runParallel(workers, [&](int w) {
+      TermDictionary& dict = segments[w];
+      size_t begin = docs.size() * w / workers, end = docs.size() * (w + 1) / workers;
+
+      for (size_t i = begin; i < end; i++) {
+        int id = docs[i].first;
+        Tokenizer tokenizer(*docs[i].second, foldCase);
+        string_view token;
+        size_t hash;
+        uint32_t position = 0;
+
+        for (; tokenizer.next(token, hash); position++) {
+          dict.occurrences[dict.intern(token, hash)].add(id, position);
+        }
+
+        lengths[w].push_back({id, position});
+      }
+
+      for (size_t term = 0; term < dict.terms.size(); term++) {
+        partitions[w][dict.hashes[term] % workers].push_back(term);
+      }
+
+      for (auto& partition: partitions[w]) {
+        sort(partition.begin(), partition.end(), [&dict](int a, int b) {
+          return dict.terms[a] < dict.terms[b];
+        });
+      }
+    });
+
+    vector<vector<uint8_t>> bytes(workers);
+    vector<vector<BlockSkip>> skips(workers);
+    vector<vector<TermPostings>> terms(workers);
+
+    runParallel(workers, [&](int p) {
+      // Min-heap of (term, segment, position in that segment's partition p)
+      typedef tuple<string_view, int, size_t> Head;
+      priority_queue<Head, vector<Head>, greater<Head>> heads;
+      Occurrences merged;
+
+      for (int s = 0; s < workers; s++) {
+        if (!partitions[s][p].empty()) {
+          heads.push({segments[s].terms[partitions[s][p][0]], s, 0});
+        }
+      }
+
+      while (!heads.empty()) {
+        string_view term = get<0>(heads.top());
+
+        merged.clear();
+
+        // Equal terms pop in segment order, so appending keeps ids sorted
+        while (!heads.empty() && get<0>(heads.top()) == term) {
+          int s = get<1>(heads.top());
+          size_t pos = get<2>(heads.top());
+          heads.pop();
+          merged.append(segments[s].occurrences[partitions[s][p][pos]]);
+
+          if (++pos < partitions[s][p].size()) {
+            heads.push({segments[s].terms[partitions[s][p][pos]], s, pos});
+          }
+        }
+
+        terms[p].push_back({string(term), bytes[p].size(), skips[p].size(), merged.docs.size()});
+        encodePostings(merged, bytes[p], skips[p]);
+      }
+    });
+
+    vector<uint8_t> allBytes;
+    vector<BlockSkip> allSkips;
+    vector<TermPostings> allTerms;
+
+    for (int p = 0; p < workers; p++) {
+      for (TermPostings& term: terms[p]) {
+        term.byteStart += allBytes.size();
+        term.skipStart += allSkips.size();
+        allTerms.push_back(move(term));
+      }
+
+      allBytes.insert(allBytes.end(), bytes[p].begin(), bytes[p].end());
+      allSkips.insert(allSkips.end(), skips[p].begin(), skips[p].end());
+    }
+
+    unordered_map<int, uint32_t> docLengths;
+
+    docLengths.reserve(docs.size());
+
+    for (auto& worker: lengths) {
+      docLengths.insert(worker.begin(), worker.end());
+    }
+
+    return InvertedIndex(move(allBytes), move(allSkips), allTerms, move(docLengths));
+  }
+
+private:
+  // Run task(0) .. task(n - 1) with the calling thread taking task 0
+  template <class Task>
+  static void runParallel(int n, Task task) {
+    vector<thread> pool;
+
+    for (int i = 1; i < n; i++) {
+      pool.emplace_back(task, i);
+    }
+
+    task(0);
+
+    for (auto& t: pool) {
+      t.join();
+    }
+  }
+
+  int threads;
+  bool foldCase;
+};
+
+InvertedIndex::InvertedIndex(unordered_map<int, string>& documents)
+  : InvertedIndex(InvertedIndexBuilder(1).build(documents)) { }
+
+// Index file written by InvertedIndex::save in host byte order and mapped by
+// MappedIndex. The header is followed by these sections, each starting on an
+// 8 byte boundary: the offset of every dictionary block, the term dictionary,
+// one IndexFileTerm per term in dictionary order, the skip tables, the doc
+// lengths sorted by doc, and the posting bytes with their decoder padding.
+//
+// The dictionary holds the sorted terms front coded in blocks of
+// DICTIONARY_BLOCK: each term is a varint count of bytes shared with the
+// previous term, a varint suffix length and the suffix, and the first term
+// of a block shares nothing so a lookup can binary search the block starts.
+const char INDEX_FILE_MAGIC[8] = {'I', 'I', 'D', 'X', '0', '0', '0', '1'};
+const size_t DICTIONARY_BLOCK = 16;
+
+struct IndexFileHeader {
+  char magic[8];
+  uint64_t fileSize;
+  uint64_t termCount;
+  uint64_t skipCount;
+  uint64_t docCount;
+  uint64_t blockTableOffset;
+  uint64_t dictionaryOffset;
+  uint64_t dictionarySize;
+  uint64_t termTableOffset;
+  uint64_t skipOffset;
+  uint64_t docOffset;
+  uint64_t postingOffset;
+  uint64_t postingSize;
+  float avgDocLength;
+  uint32_t reserved;
+};
+
+// Where a term's postings start in the posting and skip sections
+struct IndexFileTerm {
+  uint64_t byteStart;
+  uint64_t skipStart;
+  uint64_t count;
+  float maxScore;
+  uint32_t reserved;
+};
+
+struct IndexFileDoc {
+  int32_t doc;
+  uint32_t length;
+};
+
+void appendVarint(string& out, uint64_t value) {
+  while (value >= 0x80) {
+    out += (char) (value | 0x80);
+    value >>= 7;
+  }
+
+  out += (char) value;
+}
+
+// Read a varint ending before end, nullptr if it does not
+const uint8_t* readVarint(const uint8_t* p, const uint8_t* end, uint64_t& value) {
+  value = 0;
+
+  for (int shift = 0; p < end && shift < 64; shift += 7) {
+    uint8_t byte = *p++;
+
+    value |= (uint64_t) (byte & 0x7f) << shift;
+
+    if (byte < 0x80) {
+      return p;
+    }
+  }
+
+  return nullptr;
+}
+
+bool InvertedIndex::save(const string& path) const {
+  vector<pair<string_view, const PostingList*>> terms;
+
+  for (auto& entry: wordToPostings) {
+    terms.emplace_back(entry.first, &entry.second);
+  }
+
+  sort(terms.begin(), terms.end());
+
+  string dictionary;
+  vector<uint64_t> blockOffsets;
+  vector<IndexFileTerm> entries;
+
+  for (size_t i = 0; i < terms.size(); i++) {
+    string_view word = terms[i].first;
+    const PostingList& list = *terms[i].second;
+    size_t shared = 0;
+
+    if (i % DICTIONARY_BLOCK == 0) {
+      blockOffsets.push_back(dictionary.size());
+    } else {
+      string_view prev = terms[i - 1].first;
+
+      while (shared < min(prev.size(), word.size()) && prev[shared] == word[shared]) {
+        shared++;
+      }
+    }
+
+    appendVarint(dictionary, shared);
+    appendVarint(dictionary, word.size() - shared);
+    dictionary.append(word.substr(shared));
+
+    entries.push_back({(uint64_t) (list.data - bytes.data()), (uint64_t) (list.skips - skips.data()),
+                       list.count, list.bestScore, 0});
+  }
+
+  vector<IndexFileDoc> docs;
+
+  for (auto& entry: docLengths) {
+    docs.push_back({entry.first, entry.second});
+  }
+
+  sort(docs.begin(), docs.end(), [](const IndexFileDoc& a, const IndexFileDoc& b) { return a.doc < b.doc; });
+
+  IndexFileHeader header = {};
+  size_t offset = sizeof(header);
+  auto place = [&offset](size_t size) {
+    size_t start = (offset + 7) & ~(size_t) 7;
+    offset = start + size;
+    return start;
+  };
+
+  memcpy(header.magic, INDEX_FILE_MAGIC, sizeof(header.magic));
+  header.termCount = entries.size();
+  header.skipCount = skips.size();
+  header.docCount = docs.size();
+  header.blockTableOffset = place(blockOffsets.size() * sizeof(uint64_t));
+  header.dictionaryOffset = place(dictionary.size());
+  header.dictionarySize = dictionary.size();
+  header.termTableOffset = place(entries.size() * sizeof(IndexFileTerm));
+  header.skipOffset = place(skips.size() * sizeof(BlockSkip));
+  header.docOffset = place(docs.size() * sizeof(IndexFileDoc));
+  header.postingOffset = place(bytes.size());
+  header.postingSize = bytes.size();
+  header.avgDocLength = avgDocLength;
+  header.fileSize = offset;
+
+  ofstream out(path, ios::binary | ios::trunc);
+  size_t written = 0;
+  auto put = [&out, &written](size_t at, const void* data, size_t size) {
+    static const char zeros[8] = {0};
+
+    out.write(zeros, at - written);
+    out.write(static_cast<const char*>(data), size);
+    written = at + size;
+  };
+
+  put(0, &header, sizeof(header));
+  put(header.blockTableOffset, blockOffsets.data(), blockOffsets.size() * sizeof(uint64_t));
+  put(header.dictionaryOffset, dictionary.data(), dictionary.size());
+  put(header.termTableOffset, entries.data(), entries.size() * sizeof(IndexFileTerm));
+  put(header.skipOffset, skips.data(), skips.size() * sizeof(BlockSkip));
+  put(header.docOffset, docs.data(), docs.size() * sizeof(IndexFileDoc));
+  put(header.postingOffset, bytes.data(), bytes.size());
+  out.close();
+
+  return !out.fail();
+}
+
+// Read-only index over a file written by InvertedIndex::save. The file is
+// mapped rather than read, so opening costs a header check whatever the
+// index size, pages are faulted in as queries touch them, and processes
+// mapping the same file share them through the page cache. find returns a
+// fresh posting list view by value, so nothing grows with the number of
+// terms queried. Opening checks that every section lies inside the file,
+// and the first lookup of a term checks that each block of its skip table
+// decodes inside the posting bytes; a fixed table of recently checked terms
+// spares later lookups that pass. The decoded values themselves are trusted
+// as they are in the in-heap index.
+class MappedIndex {
+public:
+  MappedIndex() : base(nullptr), length(0), header(nullptr) { }
+
+  ~MappedIndex() {
+    close();
+  }
+
+  MappedIndex(const MappedIndex&) = delete;
+  MappedIndex& operator=(const MappedIndex&) = delete;
+
+  // Map an index file, false if it cannot be read or is not an index file
+  bool open(const string& path) {
+    close();
+
+    int fd = ::open(path.c_str(), O_RDONLY);
+
+    if (fd < 0) {
+      return false;
+    }
+
+    struct stat st;
+    void* p = MAP_FAILED;
+
+    if (fstat(fd, &st) == 0 && (size_t) st.st_size >= sizeof(IndexFileHeader)) {
+      p = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    }
+
+    ::close(fd);
+
+    if (p == MAP_FAILED) {
+      return false;
+    }
+
+    base = static_cast<const uint8_t*>(p);
+    length = st.st_size;
+    header = reinterpret_cast<const IndexFileHeader*>(base);
+
+    if (!valid()) {
+      close();
+      return false;
+    }
+
+    checked.reset(new atomic<uint64_t>[CHECKED_SLOTS]());
+    blockOffsets = reinterpret_cast<const uint64_t*>(base + header->blockTableOffset);
+    dictionary = base + header->dictionaryOffset;
+    termTable = reinterpret_cast<const IndexFileTerm*>(base + header->termTableOffset);
+    skips = reinterpret_cast<const BlockSkip*>(base + header->skipOffset);
+    docs = reinterpret_cast<const IndexFileDoc*>(base + header->docOffset);
+    postings = base + header->postingOffset;
+
+    return true;
+  }
+
+  void close() {
+    if (base) {
+      munmap(const_cast<uint8_t*>(base), length);
+    }
+
+    base = nullptr;
+    length = 0;
+    header = nullptr;
+    checked.reset();
+  }
+
+  bool isOpen() const {
+    return base != nullptr;
+  }
+
+  size_t termCount() const {
+    return header->termCount;
+  }
+
+  size_t docCount() const {
+    return header->docCount;
+  }
+
+  // Postings of word, or nothing if it does not occur or its skip table
+  // points outside the posting bytes
+  optional<PostingList> find(const string& word) const {
+    PostingList list;
+
+    if (!lookup(word, list)) {
+      return nullopt;
+    }
+
+    return list;
+  }
+
+  uint32_t docLength(int doc) const {
+    const IndexFileDoc* end = docs + header->docCount;
+    const IndexFileDoc* it =
+      lower_bound(docs, end, doc, [](const IndexFileDoc& entry, int doc) { return entry.doc < doc; });
+
+    return it != end && it->doc == doc ? it->length : 0;
+  }
+
+  float idf(size_t df) const {
+    return bm25Idf(header->docCount, df);
+  }
+
+  float termScore(float idf, uint32_t freq, uint32_t length) const {
+    return bm25TermScore(idf, freq, length, header->avgDocLength);
+  }
+
+private:
+  static const size_t CHECKED_SLOTS = 4096;
+
+  // Whether count items of width bytes at offset lie inside the file
+  bool inFile(uint64_t offset, uint64_t count, size_t width) const {
+    return offset % 8 == 0 && offset <= length && count <= (length - offset) / width;
+  }
+
+  bool valid() const {
+    uint64_t blocks = (header->termCount + DICTIONARY_BLOCK - 1) / DICTIONARY_BLOCK;
+
+    return memcmp(header->magic, INDEX_FILE_MAGIC, sizeof(header->magic)) == 0 &&
+           header->fileSize == length &&
+           header->termCount <= length &&
+           inFile(header->blockTableOffset, blocks, sizeof(uint64_t)) &&
+           inFile(header->dictionaryOffset, header->dictionarySize, 1) &&
+           inFile(header->termTableOffset, header->termCount, sizeof(IndexFileTerm)) &&
+           inFile(header->skipOffset, header->skipCount, sizeof(BlockSkip)) &&
+           inFile(header->docOffset, header->docCount, sizeof(IndexFileDoc)) &&
+           inFile(header->postingOffset, header->postingSize, 1) &&
+           header->postingSize >= STREAMVBYTE_PADDING;
+  }
+
+  // Decode the dictionary entry at p, advancing p; false if it runs past the
+  // dictionary or shares more bytes than the previous term has
+  bool readTerm(const uint8_t*& p, string& term) const {
+    const uint8_t* end = dictionary + header->dictionarySize;
+    uint64_t shared, suffix;
+
+    if (!(p = readVarint(p, end, shared)) || !(p = readVarint(p, end, suffix)) ||
+        shared > term.size() || suffix > (uint64_t) (end - p)) {
+      return false;
+    }
+
+    term.resize(shared);
+    term.append(reinterpret_cast<const char*>(p), suffix);
+    p += suffix;
+
+    return true;
+  }
+
+  bool lookup(string_view word, PostingList& list) const {
+    size_t blocks = (header->termCount + DICTIONARY_BLOCK - 1) / DICTIONARY_BLOCK;
+    size_t lo = 0, hi = blocks;
+    string term;
+
+    // First block whose first term is past word
+    while (lo < hi) {
+      size_t mid = (lo + hi) / 2;
+      const uint8_t* p = blockStart(mid);
+
+      term.clear();
+
+      if (p && readTerm(p, term) && term <= word) {
+        lo = mid + 1;
+      } else {
+        hi = mid;
+      }
+    }
+
+    if (lo == 0) {
+      return false;
+    }
+
+    size_t block = lo - 1;
+    size_t last = min<size_t>(header->termCount, (block + 1) * DICTIONARY_BLOCK);
+    const uint8_t* p = blockStart(block);
+
+    term.clear();
+
+    for (size_t i = block * DICTIONARY_BLOCK; p && i < last; i++) {
+      if (!readTerm(p, term) || term > word) {
+        return false;
+      }
+
+      if (term == word) {
+        return makeList(i, list);
+      }
+    }
+
+    return false;
+  }
+
+  const uint8_t* blockStart(size_t block) const {
+    return blockOffsets[block] < header->dictionarySize ? dictionary + blockOffsets[block] : nullptr;
+  }
+
+  bool makeList(size_t term, PostingList& list) const {
+    const IndexFileTerm& entry = termTable[term];
+    uint64_t blocks = (entry.count + POSTING_BLOCK - 1) / POSTING_BLOCK;
+
+    if (entry.count == 0 || entry.byteStart > header->postingSize - STREAMVBYTE_PADDING ||
+        entry.skipStart > header->skipCount || blocks > header->skipCount - entry.skipStart) {
+      return false;
+    }
+
+    list = PostingList(postings + entry.byteStart, skips + entry.skipStart, entry.count, entry.maxScore);
+
+    // A slot holds the last term that passed, plus one
+    atomic<uint64_t>& slot = checked[term % CHECKED_SLOTS];
+
+    if (slot.load(memory_order_relaxed) == term + 1) {
+      return true;
+    }
+
+    if (!skipsFit(entry, list)) {
+      return false;
+    }
+
+    slot.store(term + 1, memory_order_relaxed);
+
+    return true;
+  }
+
+  // Whether the last docs of the blocks increase and each block's doc id,
+  // frequency and position streams end inside the posting bytes, leaving
+  // the padding the SIMD decoder reads past the end of a stream
+  bool skipsFit(const IndexFileTerm& entry, const PostingList& list) const {
+    const uint8_t* data = postings + entry.byteStart;
+    uint64_t room = header->postingSize - STREAMVBYTE_PADDING - entry.byteStart;
+    uint32_t freqs[POSTING_BLOCK];
+    long long prev = LLONG_MIN;
+
+    for (size_t b = 0; b < list.blockCount(); b++) {
+      const BlockSkip& skip = list.skip(b);
+      size_t n = list.blockSize(b);
+
+      if (skip.lastDoc <= prev || !streamFits(data, skip.offset, n, room) ||
+          !streamFits(data, skip.freqOffset, n, room) ||
+          !streamFits(data, skip.posOffset, list.decodeFreqs(b, freqs), room)) {
+        return false;
+      }
+
+      prev = skip.lastDoc;
+    }
+
+    return true;
+  }
+
+  // Whether the StreamVByte stream of n values at offset ends within room
+  static bool streamFits(const uint8_t* data, uint64_t offset, uint64_t n, uint64_t room) {
+    uint64_t size = (n + 3) / 4;
+
+    if (offset > room || size > room - offset) {
+      return false;
+    }
+
+    for (uint64_t i = 0; i < n; i++) {
+      size += (data[offset + i / 4] >> (2 * (i % 4)) & 3) + 1;
+    }
+
+    return size <= room - offset;
+  }
+
+  const uint8_t* base;
+  size_t length;
+  const IndexFileHeader* header;
+  const uint64_t* blockOffsets;
+  const uint8_t* dictionary;
+  const IndexFileTerm* termTable;
+  const BlockSkip* skips;
+  const IndexFileDoc* docs;
+  const uint8_t* postings;
+  unique_ptr<atomic<uint64_t>[]> checked;
+};
+
+// Boolean query tree. NOT only excludes docs from the AND it appears in; on
+// its own it matches nothing since the index keeps no list of all docs.
+struct Query {
+  enum Op { TERM, AND, OR, NOT, PHRASE };
+
+  Op op;
+  vector<string> words;
+  vector<Query> children;
+
+  static Query term(const string& word) {
+    return {TERM, {word}, {}};
+  }
+
+  // Words that must occur at consecutive positions
+  static Query phrase(const vector<string>& words) {
+    return {PHRASE, words, {}};
+  }
+
+  static Query all(const vector<Query>& children) {
+    return {AND, {}, children};
+  }
+
+  static Query any(const vector<Query>& children) {
+    return {OR, {}, children};
+  }
+
+  static Query none(const Query& child) {
+    return {NOT, {}, {child}};
+  }
+};
+
+// Document-at-a-time cursor over the docs matching a query node
+class DocCursor {
+public:
+  static const int END = INT_MAX;
+
+  virtual ~DocCursor() { }
+
+  virtual int doc() const = 0;
+
+  virtual void next() = 0;
+
+  // Move to the first match >= target
+  virtual void advance(int target) = 0;
+
+  // Upper bound on the number of matches, used to order intersections
+  virtual size_t cost() const = 0;
+};
+
+class EmptyCursor : public DocCursor {
+public:
+  int doc() const override { return END; }
+  void next() override { }
+  void advance(int) override { }
+  size_t cost() const override { return 0; }
+};
+
+class TermCursor : public DocCursor {
+public:
+  TermCursor(const PostingList& list) : it(list), size(list.size()) { }
+
+  int doc() const override { return it.doc(); }
+  void next() override { it.next(); }
+  void advance(int target) override { it.advance(target); }
+  size_t cost() const override { return size; }
+
+  uint32_t freq() { return it.freq(); }
+  const uint32_t* positions() { return it.positions(); }
+
+private:
+  PostingList::Iterator it;
+  size_t size;
+};
+
+// Intersection of the required cursors minus the excluded ones. Cursors are
+// ordered by cost so the rarest one leads and every other cursor only gallops
+// to the lead's candidates.
+class AndCursor : public DocCursor {
+public:
+  AndCursor(vector<unique_ptr<DocCursor>> required, vector<unique_ptr<DocCursor>> excluded)
+    : required(move(required)), excluded(move(excluded)), current(END) {
+    sort(this->required.begin(), this->required.end(),
+         [](const unique_ptr<DocCursor>& a, const unique_ptr<DocCursor>& b) {
+           return a->cost() < b->cost();
+         });
+
+    align();
+  }
+
+  int doc() const override { return current; }
+
+  void next() override {
+    required[0]->next();
+    align();
+  }
+
+  void advance(int target) override {
+    if (target > current) {
+      required[0]->advance(target);
+      align();
+    }
+  }
+
+  size_t cost() const override { return required[0]->cost(); }
+
+protected:
+  // Move every cursor to the first doc from the lead's on that matches.
+  // Subclasses overriding confirm align again in their constructor, since
+  // the base constructor only sees the base confirm.
+  void align() {
+    int candidate = required[0]->doc();
+
+    while (candidate != END) {
+      bool agreed = true;
+
+      for (size_t i = 1; i < required.size() && agreed; i++) {
+        required[i]->advance(candidate);
+
+        if (required[i]->doc() != candidate) {
+          required[0]->advance(required[i]->doc());
+          agreed = false;
+        }
+      }
+
+      for (size_t i = 0; i < excluded.size() && agreed; i++) {
+        excluded[i]->advance(candidate);
+
+        if (excluded[i]->doc() == candidate) {
+          required[0]->next();
+          agreed = false;
+        }
+      }
+
+      if (agreed && !confirm()) {
+        required[0]->next();
+        agreed = false;
+      }
+
+      if (agreed) {
+        break;
+      }
+
+      candidate = required[0]->doc();
+    }
+
+    current = candidate;
+  }
+
+  // Extra check once all required cursors sit on the same doc
+  virtual bool confirm() { return true; }
+
+  vector<unique_ptr<DocCursor>> required;
+  vector<unique_ptr<DocCursor>> excluded;
+  int current;
+};
+
+// Docs containing the terms at consecutive positions
+class PhraseCursor : public AndCursor {
+public:
+  PhraseCursor(vector<unique_ptr<DocCursor>> terms, vector<TermCursor*> order)
+    : AndCursor(move(terms), {}), order(move(order)) {
+    align();
+  }
+
+protected:
+  bool confirm() override {
+    const uint32_t* first = order[0]->positions();
+    uint32_t firstNum = order[0]->freq();
+
+    for (uint32_t k = 0; k < firstNum; k++) {
+      bool found = true;
+
+      for (size_t i = 1; i < order.size() && found; i++) {
+        const uint32_t* positions = order[i]->positions();
+
+        found = binary_search(positions, positions + order[i]->freq(), first[k] + i);
+      }
+
+      if (found) {
+        return true;
+      }
+    }
+
+    return false;
+  }
+
+private:
+  vector<TermCursor*> order;
+};
+
+class OrCursor : public DocCursor {
+public:
+  OrCursor(vector<unique_ptr<DocCursor>> children) : children(move(children)) {
+    update();
+  }
+
+  int doc() const override { return current; }
+
+  void next() override {
+    for (auto& child: children) {
+      if (child->doc() == current) {
+        child->next();
+      }
+    }
+
+    update();
+  }
+
+  void advance(int target) override {
+    for (auto& child: children) {
+      child->advance(target);
+    }
+
+    update();
+  }
+
+  size_t cost() const override {
+    size_t total = 0;
+
+    for (auto& child: children) {
+      total += child->cost();
+    }
+
+    return total;
+  }
+
+private:
+  void update() {
+    current = END;
+
+    for (auto& child: children) {
+      current = min(current, child->doc());
+    }
+  }
+
+  vector<unique_ptr<DocCursor>> children;
+  int current;
+};
+
+// Evaluates Query trees over an InvertedIndex or a MappedIndex
+template <class Index = InvertedIndex>
+class QueryEngine {
+public:
+  QueryEngine(const Index& index) : index(index) { }
+
+  // Ids of up to k matching docs in increasing order, stopping as soon as
+  // k have been found
+  vector<int> search(const Query& query, size_t k = SIZE_MAX) const {
+    unique_ptr<DocCursor> cursor = open(query);
+    vector<int> ret;
+
+    while (ret.size() < k && cursor->doc() != DocCursor::END) {
+      ret.push_back(cursor->doc());
+
+      if (ret.size() < k) {
+        cursor->next();
+      }
+    }
+
+    return ret;
+  }
+
+  unique_ptr<DocCursor> open(const Query& query) const {
+    switch (query.op) {
+    case Query::TERM: {
+      auto list = index.find(query.words[0]);
+
+      if (!list) {
+        return unique_ptr<DocCursor>(new EmptyCursor());
+      }
+
+      return unique_ptr<DocCursor>(new TermCursor(*list));
+    }
+    case Query::PHRASE: {
+      vector<unique_ptr<DocCursor>> terms;
+      vector<TermCursor*> order;
+
+      for (const string& word: query.words) {
+        auto list = index.find(word);
+
+        if (!list) {
+          return unique_ptr<DocCursor>(new EmptyCursor());
+        }
+
+        order.push_back(new TermCursor(*list));
+        terms.emplace_back(order.back());
+      }
+
+      if (terms.empty()) {
+        return unique_ptr<DocCursor>(new EmptyCursor());
+      }
+
+      return unique_ptr<DocCursor>(new PhraseCursor(move(terms), move(order)));
+    }
+    case Query::AND: {
+      vector<unique_ptr<DocCursor>> required, excluded;
+
+      for (const Query& child: query.children) {
+        if (child.op == Query::NOT) {
+          excluded.push_back(open(child.children[0]));
+        } else {
+          required.push_back(open(child));
+        }
+      }
+
+      if (required.empty()) {
+        return unique_ptr<DocCursor>(new EmptyCursor());
+      }
+
+      return unique_ptr<DocCursor>(new AndCursor(move(required), move(excluded)));
+    }
+    case Query::OR: {
+      vector<unique_ptr<DocCursor>> children;
+
+      for (const Query& child: query.children) {
+        children.push_back(open(child));
+      }
+
+      return unique_ptr<DocCursor>(new OrCursor(move(children)));
+    }
+    default:
+      return unique_ptr<DocCursor>(new EmptyCursor());
+    }
+  }
+
+private:
+  const Index& index;
+};
+
+// Top-k BM25 ranking of docs containing any of the query words. topK uses
+// Block-Max WAND: terms are kept sorted by current doc and a pivot is only
+// scored when the sum of the term upper bounds up to it, and then the sum of
+// the max scores of the blocks holding it, beat the k-th best score so far.
+// Blocks that cannot beat it are skipped without being decoded.
+template <class Index = InvertedIndex>
+class Bm25Ranker {
+public:
+  typedef pair<int, float> ScoredDoc;
+
+  Bm25Ranker(const Index& index) : index(index) { }
+
+  // Best k docs by descending score, ties by ascending doc
+  vector<ScoredDoc> topK(const vector<string>& words, size_t k) const {
+    vector<Term> terms = open(words);
+    vector<Term*> order;
+    TopK best(k);
+
+    for (Term& term: terms) {
+      order.push_back(&term);
+    }
+
+    while (true) {
+      sort(order.begin(), order.end(), [](Term* a, Term* b) { return a->it.doc() < b->it.doc(); });
+
+      // Pivot: first term at which the upper bounds add up past the threshold
+      float threshold = best.threshold();
+      float bound = 0;
+      size_t p = 0;
+
+      for (; p < order.size() && order[p]->it.doc() != PostingList::Iterator::END; p++) {
+        bound += order[p]->list.maxScore();
+
+        if (bound > threshold) {
+          break;
+        }
+      }
+
+      if (p == order.size() || order[p]->it.doc() == PostingList::Iterator::END) {
+        break;
+      }
+
+      int pivot = order[p]->it.doc();
+
+      while (p + 1 < order.size() && order[p + 1]->it.doc() == pivot) {
+        p++;
+      }
+
+      // Tighter bound from the blocks that would hold the pivot
+      float blockBound = 0;
+      int next = PostingList::Iterator::END;
+
+      for (size_t i = 0; i <= p; i++) {
+        size_t block = order[i]->it.findBlock(pivot);
+
+        // A list that ends before the pivot contributes nothing from here on
+        if (block < order[i]->list.blockCount()) {
+          const BlockSkip& skip = order[i]->list.skip(block);
+
+          blockBound += skip.maxScore;
+          next = min(next, skip.lastDoc + 1);
+        }
+      }
+
+      if (blockBound <= threshold) {
+        if (p + 1 < order.size()) {
+          next = min(next, order[p + 1]->it.doc());
+        }
+
+        for (size_t i = 0; i <= p; i++) {
+          order[i]->it.advance(next);
+        }
+      } else if (order[0]->it.doc() == pivot) {
+        // Every term at the pivot, summed in query order like
+        // topKExhaustive so both get the same float score
+        uint32_t length = index.docLength(pivot);
+        float score = 0;
+
+        for (Term& term: terms) {
+          if (term.it.doc() == pivot) {
+            score += index.termScore(term.idf, term.it.freq(), length);
+            term.it.next();
+          }
+        }
+
+        best.offer(pivot, score);
+      } else {
+        for (size_t i = 0; order[i]->it.doc() < pivot; i++) {
+          order[i]->it.advance(pivot);
+        }
+      }
+    }
+
+    return best.sorted();
+  }
+
+  // Same ranking scoring every doc that contains any of the words
+  vector<ScoredDoc> topKExhaustive(const vector<string>& words, size_t k) const {
+    vector<Term> terms = open(words);
+    TopK best(k);
+
+    while (true) {
+      int doc = PostingList::Iterator::END;
+
+      for (Term& term: terms) {
+        doc = min(doc, term.it.doc());
+      }
+
+      if (doc == PostingList::Iterator::END) {
+        break;
+      }
+
+      uint32_t length = index.docLength(doc);
+      float score = 0;
+
+      for (Term& term: terms) {
+        if (term.it.doc() == doc) {
+          score += index.termScore(term.idf, term.it.freq(), length);
+          term.it.next();
+        }
+      }
+
+      best.offer(doc, score);
+    }
+
+    return best.sorted();
+  }
+
+private:
+  struct Term {
+    Term(const PostingList& list, float idf) : list(list), idf(idf), it(list) { }
+
+    PostingList list;
+    float idf;
+    PostingList::Iterator it;
+  };
+
+  // Fixed size heap of the best docs seen so far, worst on top. Docs are
+  // offered in increasing order, so a tie with the worst never gets in.
+  class TopK {
+  public:
+    TopK(size_t k) : k(k) { }
+
+    // Score a doc must beat to enter; scores are never negative
+    float threshold() const {
+      if (k == 0) {
+        return INFINITY;
+      }
+
+      return heap.size() == k ? heap.top().first : -1;
+    }
+
+    void offer(int doc, float score) {
+      if (score <= threshold()) {
+        return;
+      }
+
+      if (heap.size() == k) {
+        heap.pop();
+      }
+
+      heap.push({score, doc});
+    }
+
+    vector<ScoredDoc> sorted() {
+      vector<ScoredDoc> ret(heap.size());
+
+      for (size_t i = ret.size(); i-- > 0; heap.pop()) {
+        ret[i] = {heap.top().second, heap.top().first};
+      }
+
+      return ret;
+    }
+
+  private:
+    // Higher score first, then lower doc
+    struct Better {
+      bool operator()(const pair<float, int>& a, const pair<float, int>& b) const {
+        return a.first > b.first || (a.first == b.first && a.second < b.second);
+      }
+    };
+
+    size_t k;
+    priority_queue<pair<float, int>, vector<pair<float, int>>, Better> heap;
+  };
+
+  vector<Term> open(const vector<string>& words) const {
+    vector<Term> terms;
+
+    terms.reserve(words.size());
+
+    for (const string& word: words) {
+      auto list = index.find(word);
+
+      if (list) {
+        terms.emplace_back(*list, index.idf(list->size()));
+      }
+    }
+
+    return terms;
+  }
+
+  const Index& index;
+};
+
+// Immutable piece of an IncrementalIndex: an InvertedIndex over internal doc
+// numbers base .. base + externalIds.size() - 1, with the caller's id of each
+// (-1 for numbers that were deleted before the segment was written, which
+// are tombstoned from the start)
+struct Segment {
+  InvertedIndex index;
+  int base;
+  vector<int> externalIds;
+};
+
+// Deleted internal doc numbers of one segment, indexed by number - base
+typedef vector<bool> Tombstones;
+
+// Point-in-time view of an IncrementalIndex. Segments are ordered by base
+// and each comes with the tombstones that were current when the view was
+// published, so a reader sees the same docs for as long as it holds it.
+struct IndexSnapshot {
+  vector<shared_ptr<const Segment>> segments;
+  vector<shared_ptr<const Tombstones>> tombstones;
+
+  // Ids of up to k live matching docs in indexing order
+  vector<int> search(const Query& query, size_t k = SIZE_MAX) const {
+    vector<int> ret;
+
+    for (size_t s = 0; s < segments.size() && ret.size() < k; s++) {
+      const Segment& segment = *segments[s];
+      const Tombstones& deleted = *tombstones[s];
+      unique_ptr<DocCursor> cursor = QueryEngine(segment.index).open(query);
+
+      for (; cursor->doc() != DocCursor::END && ret.size() < k; cursor->next()) {
+        int local = cursor->doc() - segment.base;
+
+        if (!deleted[local]) {
+          ret.push_back(segment.externalIds[local]);
+        }
+      }
+    }
+
+    return ret;
+  }
+
+  size_t docCount() const {
+    size_t total = 0;
+
+    for (size_t s = 0; s < segments.size(); s++) {
+      total += count(tombstones[s]->begin(), tombstones[s]->end(), false);
+    }
+
+    return total;
+  }
+};
+
+// Index that accepts adds, updates and deletes without a rebuild. New docs
+// are buffered in a small in-memory segment that is written out as an
+// immutable Segment once it holds memtableDocs docs or on refresh(); a
+// delete only sets a bit in its segment's tombstone bitmap. Every doc
+// version gets a new internal number, so segments cover disjoint ascending
+// ranges and an update is a delete plus an add.
+//
+// A background thread merges segments with a tiered policy: a segment's tier
+// is the power of mergeFactor its doc count falls in, and whenever
+// mergeFactor adjacent segments share a tier they are rewritten as one,
+// dropping deleted docs. Readers take a snapshot and are never blocked by
+// writes or merges; changes become visible at the next refresh or flush.
+class IncrementalIndex {
 public:
-  InvertedIndex(unordered_map<int, string>& documents) {
-    for (auto& document: documents) {
-      int id = document.first;
-      string& content = document.second;
-      string token;
-      stringstream ss(content);
+  IncrementalIndex(size_t memtableDocs = 10000, size_t mergeFactor = 4)
+    : memtableDocs(memtableDocs), mergeFactor(max<size_t>(2, mergeFactor)),
+      nextInternal(0), memtableBase(0), merges(0), stopping(false),
+      current(make_shared<IndexSnapshot>()), merger(&IncrementalIndex::mergeLoop, this) { }
 
-      while (ss >> token) {
-        wordToDocs[token].insert(id);
-      }
+  ~IncrementalIndex() {
+    {
+      lock_guard<mutex> lock(mtx);
+      stopping = true;
+    }
+
+    mergeCv.notify_one();
+    merger.join();
+  }
+
+  // Add a doc, replacing any earlier version with the same id
+  void addDocument(int id, const string& content) {
+    lock_guard<mutex> lock(mtx);
+
+    removeLocked(id);
+
+    int internal = nextInternal++;
+
+    memtable[internal] = content;
+    memtableIds[internal] = id;
+    latest[id] = internal;
+
+    if (memtable.size() >= memtableDocs) {
+      flushLocked();
     }
   }
 
-  unordered_map<string, set<int>>& getInvertedIndexMap() {
-    return wordToDocs;
+  void removeDocument(int id) {
+    lock_guard<mutex> lock(mtx);
+    removeLocked(id);
+  }
+
+  // Write out buffered docs and deletes and publish a new snapshot
+  void refresh() {
+    lock_guard<mutex> lock(mtx);
+    flushLocked();
+  }
+
+  shared_ptr<const IndexSnapshot> snapshot() const {
+    return atomic_load(&current);
+  }
+
+  vector<int> search(const Query& query, size_t k = SIZE_MAX) const {
+    return snapshot()->search(query, k);
+  }
+
+  size_t mergeCount() const {
+    return merges.load();
   }
 
 private:
-  unordered_map<string, set<int>> wordToDocs;
+  void removeLocked(int id) {
+    auto it = latest.find(id);
+
+    if (it == latest.end()) {
+      return;
+    }
+
+    int internal = it->second;
+
+    latest.erase(it);
+
+    if (internal >= memtableBase) {
+      memtable.erase(internal);
+      memtableIds.erase(internal);
+    } else {
+      pendingDeletes.push_back(internal);
+    }
+  }
+
+  // Index of the segment holding an internal doc number
+  size_t segmentOf(const vector<shared_ptr<const Segment>>& segments, int internal) const {
+    size_t lo = 0, hi = segments.size();
+
+    while (hi - lo > 1) {
+      size_t mid = (lo + hi) / 2;
+
+      if (segments[mid]->base <= internal) {
+        lo = mid;
+      } else {
+        hi = mid;
+      }
+    }
+
+    return lo;
+  }
+
+  void flushLocked() {
+    if (memtableBase == nextInternal && pendingDeletes.empty()) {
+      return;
+    }
+
+    auto next = make_shared<IndexSnapshot>(*current);
+
+    // Copy each touched bitmap once for all of its pending deletes
+    if (!pendingDeletes.empty()) {
+      map<size_t, shared_ptr<Tombstones>> copies;
+
+      for (int internal: pendingDeletes) {
+        size_t s = segmentOf(next->segments, internal);
+        auto& copy = copies[s];
+
+        if (!copy) {
+          copy = make_shared<Tombstones>(*next->tombstones[s]);
+        }
+
+        (*copy)[internal - next->segments[s]->base] = true;
+      }
+
+      for (auto& entry: copies) {
+        next->tombstones[entry.first] = entry.second;
+      }
+
+      pendingDeletes.clear();
+    }
+
+    if (memtableBase < nextInternal) {
+      unordered_map<int, string> documents(memtable.begin(), memtable.end());
+      vector<int> externalIds(nextInternal - memtableBase, -1);
+      auto deleted = make_shared<Tombstones>(nextInternal - memtableBase, true);
+
+      for (auto& entry: memtableIds) {
+        externalIds[entry.first - memtableBase] = entry.second;
+        (*deleted)[entry.first - memtableBase] = false;
+      }
+
+      next->segments.push_back(make_shared<Segment>(
+        Segment{InvertedIndexBuilder(1).build(documents), memtableBase, move(externalIds)}));
+      next->tombstones.push_back(deleted);
+
+      memtable.clear();
+      memtableIds.clear();
+      memtableBase = nextInternal;
+    }
+
+    atomic_store(&current, shared_ptr<const IndexSnapshot>(next));
+    mergeCv.notify_one();
+  }
+
+  size_t tierOf(const Segment& segment) const {
+    size_t docs = segment.externalIds.size() / max<size_t>(1, memtableDocs);
+    size_t tier = 0;
+
+    while (docs >= mergeFactor) {
+      docs /= mergeFactor;
+      tier++;
+    }
+
+    return tier;
+  }
+
+  // First run of mergeFactor adjacent segments in the same tier, or empty
+  pair<size_t, size_t> pickMerge(const IndexSnapshot& snapshot) const {
+    const auto& segments = snapshot.segments;
+
+    for (size_t start = 0; start + mergeFactor <= segments.size(); start++) {
+      size_t tier = tierOf(*segments[start]);
+      size_t end = start + 1;
+
+      while (end < segments.size() && end - start < mergeFactor && tierOf(*segments[end]) == tier) {
+        end++;
+      }
+
+      if (end - start == mergeFactor) {
+        return {start, end};
+      }
+    }
+
+    return {0, 0};
+  }
+
+  // Rewrite segments [start, end) of a snapshot as one, leaving out docs
+  // deleted in that snapshot
+  static shared_ptr<Segment> mergeSegments(const IndexSnapshot& snapshot, size_t start, size_t end) {
+    map<string, Occurrences> terms;
+    vector<int> externalIds;
+    unordered_map<int, uint32_t> docLengths;
+    int base = snapshot.segments[start]->base;
+
+    for (size_t s = start; s < end; s++) {
+      const Segment& segment = *snapshot.segments[s];
+      const Tombstones& deleted = *snapshot.tombstones[s];
+
+      externalIds.insert(externalIds.end(), segment.externalIds.begin(), segment.externalIds.end());
+
+      for (auto& entry: segment.index.getDocLengths()) {
+        if (!deleted[entry.first - segment.base]) {
+          docLengths.insert(entry);
+        }
+      }
+
+      for (auto& entry: segment.index.getInvertedIndexMap()) {
+        Occurrences* occurrences = nullptr;
+
+        for (PostingList::Iterator it(entry.second); it.doc() != PostingList::Iterator::END; it.next()) {
+          if (deleted[it.doc() - segment.base]) {
+            continue;
+          }
+
+          if (!occurrences) {
+            occurrences = &terms[entry.first];
+          }
+
+          const uint32_t* positions = it.positions();
+
+          for (uint32_t i = 0; i < it.freq(); i++) {
+            occurrences->add(it.doc(), positions[i]);
+          }
+        }
+      }
+    }
+
+    vector<uint8_t> bytes;
+    vector<BlockSkip> skips;
+    vector<TermPostings> postings;
+
+    for (auto& entry: terms) {
+      postings.push_back({entry.first, bytes.size(), skips.size(), entry.second.docs.size()});
+      encodePostings(entry.second, bytes, skips);
+    }
+
+    return make_shared<Segment>(
+      Segment{InvertedIndex(move(bytes), move(skips), postings, move(docLengths)), base, move(externalIds)});
+  }
+
+  void mergeLoop() {
+    unique_lock<mutex> lock(mtx);
+
+    while (true) {
+      pair<size_t, size_t> run;
+      shared_ptr<const IndexSnapshot> base;
+
+      mergeCv.wait(lock, [&] {
+        if (stopping) {
+          return true;
+        }
+
+        base = current;
+        run = pickMerge(*base);
+
+        return run.first < run.second;
+      });
+
+      if (stopping) {
+        return;
+      }
+
+      lock.unlock();
+
+      shared_ptr<Segment> merged = mergeSegments(*base, run.first, run.second);
+
+      lock.lock();
+
+      // Only this thread removes segments, so the run is still in place at
+      // the same positions; deletes made meanwhile are in its bitmaps
+      auto next = make_shared<IndexSnapshot>(*current);
+      auto tombstones = make_shared<Tombstones>();
+
+      for (size_t s = run.first; s < run.second; s++) {
+        tombstones->insert(tombstones->end(), next->tombstones[s]->begin(), next->tombstones[s]->end());
+      }
+
+      next->segments.erase(next->segments.begin() + run.first, next->segments.begin() + run.second);
+      next->tombstones.erase(next->tombstones.begin() + run.first, next->tombstones.begin() + run.second);
+      next->segments.insert(next->segments.begin() + run.first, merged);
+      next->tombstones.insert(next->tombstones.begin() + run.first, tombstones);
+
+      atomic_store(&current, shared_ptr<const IndexSnapshot>(next));
+      merges++;
+    }
+  }
+
+  size_t memtableDocs;
+  size_t mergeFactor;
+
+  // Guarded by mtx
+  mutex mtx;
+  condition_variable mergeCv;
+  int nextInternal;
+  int memtableBase;
+  map<int, string> memtable;
+  unordered_map<int, int> memtableIds;
+  unordered_map<int, int> latest;
+  vector<int> pendingDeletes;
+
+  atomic<size_t> merges;
+  bool stopping;
+  shared_ptr<const IndexSnapshot> current;
+  thread merger;
+};
+
+// Allocator that tallies bytes in use, used to measure set<int> postings
+size_t allocatedBytes = 0;
+
+template <class T>
+struct CountingAllocator {
+  typedef T value_type;
+
+  CountingAllocator() { }
+
+  template <class U>
+  CountingAllocator(const CountingAllocator<U>&) { }
+
+  T* allocate(size_t n) {
+    allocatedBytes += n * sizeof(T);
+    return static_cast<T*>(::operator new(n * sizeof(T)));
+  }
+
+  void deallocate(T* p, size_t n) {
+    allocatedBytes -= n * sizeof(T);
+    ::operator delete(p);
+  }
+
+  template <class U>
+  bool operator==(const CountingAllocator<U>&) const { return true; }
+
+  template <class U>
+  bool operator!=(const CountingAllocator<U>&) const { return false; }
 };
 
-int main() {
+// Synthetic corpus with a Zipf-like vocabulary
+unordered_map<int, string> makeCorpus(int docNum, int wordsPerDoc, int vocabulary) {
+  unordered_map<int, string> documents;
+  unsigned seed = 42;
+
+  for (int id = 0; id < docNum; id++) {
+    string content;
+
+    for (int w = 0; w < wordsPerDoc; w++) {
+      seed = seed * 1103515245 + 12345;
+
+      double u = (seed >> 8) / double(1 << 24);
+      int rank = (int) (vocabulary * u * u * u);
+
+      content += "w" + to_string(rank) + " ";
+    }
+
+    documents[id] = content;
+  }
+
+  return documents;
+}
+
+// MB/s split into tokens by Tokenizer against stringstream >> string
+void benchmarkTokenizer(const unordered_map<int, string>& documents) {
+  string text;
+
+  for (auto& document: documents) {
+    text += document.second;
+    text += '\n';
+  }
+
+  size_t streamTokens = 0, tokens = 0, hashes = 0;
+  auto start = chrono::steady_clock::now();
+  stringstream ss(text);
+  string word;
+
+  while (ss >> word) {
+    streamTokens++;
+  }
+
+  auto mid = chrono::steady_clock::now();
+  Tokenizer tokenizer(text);
+  string_view token;
+  size_t hash;
+
+  while (tokenizer.next(token, hash)) {
+    tokens++;
+    hashes ^= hash;
+  }
+
+  auto end = chrono::steady_clock::now();
+
+  assert(tokens == streamTokens);
+
+  double mb = text.size() / 1e6;
+
+  cout << "stringstream " << mb / chrono::duration<double>(mid - start).count() << " MB/s" << endl;
+  cout << "tokenizer    " << mb / chrono::duration<double>(end - mid).count() << " MB/s"
+       << " checksum " << (hashes & 0xffff) << endl;
+}
+
+// Latency of 2 to 8 term queries mixing common and rare words. AND is
+// compared with the old approach of intersecting copied doc lists one by one.
+void benchmarkQueries(const InvertedIndex& invertedIndex) {
+  QueryEngine engine(invertedIndex);
+  unsigned seed = 7;
+  auto word = [&seed](bool common) {
+    seed = seed * 1103515245 + 12345;
+    return "w" + to_string(common ? (seed >> 16) % 20 : 2000 + (seed >> 16) % 20000);
+  };
+
+  for (int terms = 2; terms <= 8; terms++) {
+    const int queries = 100;
+    double copySecs = 0, andSecs = 0, orSecs = 0, phraseSecs = 0;
+
+    for (int q = 0; q < queries; q++) {
+      vector<Query> children;
+      vector<string> words;
+
+      for (int t = 0; t < terms; t++) {
+        words.push_back(word(t % 2 == 0));
+        children.push_back(Query::term(words.back()));
+      }
+
+      auto start = chrono::steady_clock::now();
+      vector<int> result = invertedIndex.find(words[0])->toVector();
+
+      for (int t = 1; t < terms; t++) {
+        vector<int> docs = invertedIndex.find(words[t])->toVector(), merged;
+
+        set_intersection(result.begin(), result.end(), docs.begin(), docs.end(), back_inserter(merged));
+        result.swap(merged);
+      }
+
+      auto t1 = chrono::steady_clock::now();
+      vector<int> matches = engine.search(Query::all(children));
+      auto t2 = chrono::steady_clock::now();
+      engine.search(Query::any(children), 100);
+      auto t3 = chrono::steady_clock::now();
+      engine.search(Query::phrase(vector<string>(words.begin(), words.begin() + 2)));
+      auto t4 = chrono::steady_clock::now();
+
+      assert(matches == result);
+
+      copySecs += chrono::duration<double>(t1 - start).count();
+      andSecs += chrono::duration<double>(t2 - t1).count();
+      orSecs += chrono::duration<double>(t3 - t2).count();
+      phraseSecs += chrono::duration<double>(t4 - t3).count();
+    }
+
+    cout << "terms=" << terms
+         << " copy+intersect " << copySecs / queries * 1e6 << " us"
+         << " AND " << andSecs / queries * 1e6 << " us"
+         << " OR top100 " << orSecs / queries * 1e6 << " us"
+         << " phrase2 " << phraseSecs / queries * 1e6 << " us" << endl;
+  }
+}
+
+// Exhaustive against Block-Max WAND BM25 latency at k = 10 and k = 1000
+void benchmarkRanking(const InvertedIndex& invertedIndex) {
+  Bm25Ranker ranker(invertedIndex);
+  unsigned seed = 5;
+
+  for (size_t k: {10, 1000}) {
+    for (int terms = 2; terms <= 5; terms++) {
+      const int queries = 50;
+      double exhaustiveSecs = 0, prunedSecs = 0;
+
+      for (int q = 0; q < queries; q++) {
+        vector<string> words;
+
+        for (int t = 0; t < terms; t++) {
+          seed = seed * 1103515245 + 12345;
+          words.push_back("w" + to_string(t % 2 == 0 ? (seed >> 16) % 50 : 500 + (seed >> 16) % 5000));
+        }
+
+        auto start = chrono::steady_clock::now();
+        auto exhaustive = ranker.topKExhaustive(words, k);
+        auto mid = chrono::steady_clock::now();
+        auto pruned = ranker.topK(words, k);
+        auto end = chrono::steady_clock::now();
+
+        bool same = exhaustive.size() == pruned.size();
+
+        for (size_t i = 0; same && i < pruned.size(); i++) {
+          same = exhaustive[i].first == pruned[i].first &&
+                 fabs(exhaustive[i].second - pruned[i].second) <= 1e-5f * max(1.0f, exhaustive[i].second);
+        }
+
+        assert(same);
+
+        exhaustiveSecs += chrono::duration<double>(mid - start).count();
+        prunedSecs += chrono::duration<double>(end - mid).count();
+      }
+
+      cout << "bm25 k=" << k << " terms=" << terms
+           << " exhaustive " << exhaustiveSecs / queries * 1e3 << " ms"
+           << " block-max wand " << prunedSecs / queries * 1e3 << " ms" << endl;
+    }
+  }
+}
+
+// Sustained ingest into an IncrementalIndex, one in ten adds replacing an
+// earlier doc, while another thread queries snapshots as merges run
+void benchmarkIncremental(const unordered_map<int, string>& documents) {
+  IncrementalIndex index(10000, 4);
+  atomic<bool> done(false);
+  vector<double> latencies;
+
+  thread reader([&] {
+    unsigned seed = 11;
+
+    while (!done.load()) {
+      seed = seed * 1103515245 + 12345;
+
+      Query query = Query::all({Query::term("w" + to_string((seed >> 16) % 20)),
+                                Query::term("w" + to_string(2000 + (seed >> 8) % 20000))});
+      auto start = chrono::steady_clock::now();
+
+      index.search(query);
+      latencies.push_back(chrono::duration<double>(chrono::steady_clock::now() - start).count());
+    }
+  });
+
+  auto start = chrono::steady_clock::now();
+  int added = 0;
+
+  for (auto& document: documents) {
+    index.addDocument(added % 10 == 9 ? added / 2 : document.first, document.second);
+    added++;
+  }
+
+  index.refresh();
+
+  double secs = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+  done = true;
+  reader.join();
+  sort(latencies.begin(), latencies.end());
+
+  cout << "incremental ingest " << added / secs << " docs/s, merges " << index.mergeCount()
+       << ", segments " << index.snapshot()->segments.size()
+       << ", query p50 " << latencies[latencies.size() / 2] * 1e6 << " us"
+       << " p99 " << latencies[latencies.size() * 99 / 100] * 1e6 << " us" << endl;
+}
+
+// Docs/sec of the parallel builder from one thread up to all cores
+void benchmarkBuild(const unordered_map<int, string>& documents) {
+  int cores = max(1u, thread::hardware_concurrency());
+
+  for (int threads = 1; ; threads = min(threads * 2, cores)) {
+    auto start = chrono::steady_clock::now();
+    InvertedIndex invertedIndex = InvertedIndexBuilder(threads).build(documents);
+    double secs = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+    cout << "build threads=" << threads << " " << documents.size() / secs << " docs/s" << endl;
+
+    if (threads == cores) {
+      break;
+    }
+  }
+}
+
+// Resident set size of this process, 0 where /proc is missing
+size_t residentBytes() {
+  ifstream statm("/proc/self/statm");
+  size_t pages = 0, resident = 0;
+
+  statm >> pages >> resident;
+
+  return resident * sysconf(_SC_PAGESIZE);
+}
+
+// Cold open time, resident memory and query latency of a MappedIndex against
+// the in-heap index it is saved from, which took buildSecs and heapBytes
+void benchmarkMapped(const InvertedIndex& invertedIndex, double buildSecs, size_t heapBytes) {
+  const string path = "inverted_index.idx";
+  auto start = chrono::steady_clock::now();
+
+  if (!invertedIndex.save(path)) {
+    cout << "cannot write " << path << endl;
+    return;
+  }
+
+  double saveSecs = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+  // Evict the file from the page cache so opening and the first queries are cold
+  int fd = open(path.c_str(), O_RDONLY);
+  struct stat st = {};
+
+  if (fd >= 0) {
+    fstat(fd, &st);
+    fsync(fd);
+    posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+    close(fd);
+  }
+
+  size_t before = residentBytes();
+  MappedIndex mapped;
+
+  start = chrono::steady_clock::now();
+  mapped.open(path);
+
+  double openSecs = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+  size_t openBytes = residentBytes() - before;
+
+  QueryEngine<InvertedIndex> heapEngine(invertedIndex);
+  QueryEngine<MappedIndex> mappedEngine(mapped);
+  Bm25Ranker<InvertedIndex> heapRanker(invertedIndex);
+  Bm25Ranker<MappedIndex> mappedRanker(mapped);
+  const int queries = 200;
+  double heapSecs = 0, coldSecs = 0, warmSecs = 0;
+
+  for (int pass = 0; pass < 3; pass++) {
+    unsigned seed = 9;
+
+    for (int q = 0; q < queries; q++) {
+      vector<string> words;
+      vector<Query> children;
+
+      for (int t = 0; t < 3; t++) {
+        seed = seed * 1103515245 + 12345;
+        words.push_back("w" + to_string(t == 0 ? (seed >> 16) % 20 : 1000 + (seed >> 16) % 50000));
+        children.push_back(Query::term(words.back()));
+      }
+
+      auto t0 = chrono::steady_clock::now();
+      vector<int> docs;
+      vector<Bm25Ranker<>::ScoredDoc> ranked;
+
+      if (pass == 1) {
+        docs = heapEngine.search(Query::all(children));
+        ranked = heapRanker.topK(words, 10);
+      } else {
+        docs = mappedEngine.search(Query::all(children));
+        ranked = mappedRanker.topK(words, 10);
+      }
+
+      double secs = chrono::duration<double>(chrono::steady_clock::now() - t0).count();
+
+      (pass == 0 ? coldSecs : pass == 1 ? heapSecs : warmSecs) += secs;
+
+      if (pass == 1) {
+        assert(docs == mappedEngine.search(Query::all(children)));
+        assert(ranked == mappedRanker.topK(words, 10));
+      }
+    }
+  }
+
+  size_t queryBytes = residentBytes() - before;
+
+  cout << "heap   build " << buildSecs << " s, resident " << heapBytes / 1e6 << " MB"
+       << ", AND+bm25 " << heapSecs / queries * 1e6 << " us" << endl;
+  cout << "mapped save " << saveSecs << " s, file " << st.st_size / 1e6 << " MB"
+       << ", cold open " << openSecs * 1e6 << " us, resident " << openBytes / 1e3 << " KB"
+       << " after open, " << queryBytes / 1e6 << " MB after queries" << endl;
+  cout << "mapped AND+bm25 cold " << coldSecs / queries * 1e6 << " us"
+       << " warm " << warmSecs / queries * 1e6 << " us" << endl;
+
+  remove(path.c_str());
+}
+
+// Index size and full decode throughput of the blocked index against set<int>
+void benchmark() {
+  unordered_map<int, string> documents = makeCorpus(2000000, 10, 100000);
+  size_t before = residentBytes();
+  auto buildStart = chrono::steady_clock::now();
+  InvertedIndex invertedIndex(documents);
+  double buildSecs = chrono::duration<double>(chrono::steady_clock::now() - buildStart).count();
+  size_t heapBytes = residentBytes() - before;
+  typedef set<int, less<int>, CountingAllocator<int>> CountedSet;
+  unordered_map<string, CountedSet> sets;
+  size_t postings = 0;
+
+  for (auto& p: invertedIndex.getInvertedIndexMap()) {
+    vector<int> docs = p.second.toVector();
+
+    sets[p.first].insert(docs.begin(), docs.end());
+    postings += docs.size();
+  }
+
+  cout << "postings " << postings << endl;
+  cout << "set<int> " << (double) allocatedBytes / postings << " bytes/posting" << endl;
+  cout << "blocked  " << (double) invertedIndex.postingBytes() / postings << " bytes/posting"
+       << " (with frequencies and positions)" << endl;
+
+  long long checksum = 0;
+  auto start = chrono::steady_clock::now();
+
+  for (auto& p: sets) {
+    for (int doc: p.second) {
+      checksum += doc;
+    }
+  }
+
+  auto mid = chrono::steady_clock::now();
+
+  for (auto& p: invertedIndex.getInvertedIndexMap()) {
+    for (PostingList::Iterator it(p.second); it.doc() != PostingList::Iterator::END; it.next()) {
+      checksum -= it.doc();
+    }
+  }
+
+  auto end = chrono::steady_clock::now();
+
+  assert(checksum == 0);
+
+  cout << "set<int> decode " << postings / chrono::duration<double>(mid - start).count() / 1e6 << " M/s" << endl;
+  cout << "blocked  decode " << postings / chrono::duration<double>(end - mid).count() / 1e6 << " M/s" << endl;
+
+  benchmarkQueries(invertedIndex);
+  benchmarkRanking(invertedIndex);
+  benchmarkMapped(invertedIndex, buildSecs, heapBytes);
+  benchmarkIncremental(makeCorpus(500000, 10, 100000));
+  benchmarkBuild(documents);
+  benchmarkTokenizer(documents);
+}
+
+int main(int argc, char* argv[]) {
   unordered_map<int, string> documents;
 
   documents[1] = "This is the content of document 1 it is very short";
@@ -76,10 +2689,23 @@ int main() {
   auto& indexMap = invertedIndex.getInvertedIndexMap();
 
   for (auto& p: indexMap) {
+    vector<int> docs = p.second.toVector();
+
     cout << "word : " << p.first << endl; 
     cout << "Documents : ";
 
-    copy(p.second.begin(), p.second.end(), ostream_iterator<int> (cout, " "));
+    copy(docs.begin(), docs.end(), ostream_iterator<int> (cout, " "));
     cout << endl;
   }
+
+  QueryEngine engine(invertedIndex);
+  vector<int> docs = engine.search(Query::all({Query::phrase({"is", "very"}), Query::none(Query::term("short"))}));
+
+  cout << "\"is very\" AND NOT short : ";
+  copy(docs.begin(), docs.end(), ostream_iterator<int> (cout, " "));
+  cout << endl;
+
+  if (argc > 1 && string(argv[1]) == "bench") {
+    benchmark();
+  }
 }
@@ -35,19 +35,687 @@ pick()
 #include <map>
 #include <set>
 #include <string>
+#include <memory>
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <chrono>
+#include <random>
+#include <queue>
+#include <cmath>
 #include <algorithm>
 #include <iostream>
 #include <iterator>
 #include <sstream> 
+#include <climits>
 #include <cassert>
 
 using namespace std;
 
+// RANDOM picks uniformly. TWO_CHOICES samples two servers and takes the one
+// with fewer outstanding requests. LEAST_OUTSTANDING scans for the lowest
+// outstanding requests per unit of weight. PEAK_EWMA samples two servers and
+// takes the lower peak EWMA latency times outstanding requests. WEIGHTED
+// picks in proportion to weight in O(1) from an alias table.
+enum PickMode { RANDOM, TWO_CHOICES, LEAST_OUTSTANDING, PEAK_EWMA, WEIGHTED };
+
+// Seconds on a monotonic clock. The balancer reads time through a function
+// pointer so a simulation can drive it instead.
+typedef double (*Clock)();
+
+double steadySeconds() {
+  return chrono::duration<double>(chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// xorshift64* state per thread, so picks never share a generator
+inline uint64_t fastRandom() {
+  static atomic<uint64_t> seeds(0x9e3779b97f4a7c15ULL);
+  thread_local uint64_t state = seeds.fetch_add(0x9e3779b97f4a7c15ULL) | 1;
+
+  state ^= state >> 12;
+  state ^= state << 25;
+  state ^= state >> 27;
+
+  return state * 0x2545f4914f6cdd1dULL;
+}
+
+// Uniform in [0, n) by multiply-shift instead of a division
+inline size_t randomBelow(size_t n) {
+  return (size_t) (((unsigned __int128) fastRandom() * n) >> 64);
+}
+
+// Requests, errors and summed latency of one server over the last BUCKETS
+// time buckets. A bucket is two words, each tagged in its top 16 bits with
+// the bucket number its counts belong to; a writer that finds an older tag
+// starts the word over in the same CAS, so nothing locks or sweeps. The
+// counts word holds 24 bits of requests above 24 bits of errors.
+struct HealthWindow {
+  static const int BUCKETS = 10;
+
+  struct Totals {
+    uint64_t requests;
+    uint64_t errors;
+    double latency;
+  };
+
+  void record(uint64_t bucket, bool success, double latency) {
+    add(counts[bucket % BUCKETS], bucket, (1ULL << 24) + !success);
+    add(latencies[bucket % BUCKETS], bucket, (uint64_t) (latency * 1e6));
+  }
+
+  // Totals over the window ending with bucket
+  Totals read(uint64_t bucket) const {
+    Totals totals = {0, 0, 0};
+
+    for (int i = 0; i < BUCKETS; i++) {
+      uint64_t c = counts[i].load(memory_order_relaxed);
+      uint64_t l = latencies[i].load(memory_order_relaxed);
+
+      if (recent(c, bucket)) {
+        totals.requests += c >> 24 & 0xffffff;
+        totals.errors += c & 0xffffff;
+      }
+
+      if (recent(l, bucket)) {
+        totals.latency += (l & PAYLOAD) / 1e6;
+      }
+    }
+
+    return totals;
+  }
+
+private:
+  static const uint64_t PAYLOAD = (1ULL << 48) - 1;
+
+  static bool recent(uint64_t word, uint64_t bucket) {
+    return ((bucket - (word >> 48)) & 0xffff) < BUCKETS;
+  }
+
+  static void add(atomic<uint64_t>& word, uint64_t bucket, uint64_t delta) {
+    uint64_t tag = (bucket & 0xffff) << 48;
+    uint64_t old = word.load(memory_order_relaxed);
+
+    while (!word.compare_exchange_weak(old, ((old & ~PAYLOAD) == tag ? old : tag) + delta,
+                                       memory_order_relaxed)) {
+    }
+  }
+
+  atomic<uint64_t> counts[BUCKETS] = {};
+  atomic<uint64_t> latencies[BUCKETS] = {};
+};
+
+// An ejected server gets no picks until its ejection expires, then a share
+// of them on probation until its window shows whether it recovered
+enum HealthState { HEALTHY, EJECTED, PROBING };
+
+// Outlier ejection settings, times in clock seconds. The window should be
+// shorter than baseEjection so a server on probation is judged on probe
+// traffic rather than on the errors it was ejected for.
+struct HealthPolicy {
+  double window = 10;
+  size_t minRequests = 20;      // servers with fewer requests in the window are not judged
+  double maxErrorRate = 0.5;
+  double latencyFactor = 0;     // eject above this times the median mean latency, 0 disables
+  double baseEjection = 30;     // doubled for every consecutive ejection up to maxEjection
+  double maxEjection = 300;
+  double maxEjectedShare = 0.5; // never eject more than this share of servers
+  double probeFraction = 0.05;  // share of picks sent to servers on probation
+};
+
+// Load counters of one server, on a cache line of their own so picks and
+// releases on different servers do not contend
+struct alignas(64) ServerLoad {
+  ServerLoad(int id, double weight)
+    : id(id), weight(weight), outstanding(0), ewma(0), lastUpdate(0),
+      health(HEALTHY), ejections(0), ejectedUntil(0) { }
+
+  int id;
+  atomic<double> weight;
+  atomic<int> outstanding;
+
+  // Peak EWMA latency in seconds; lastUpdate is guarded by lock
+  atomic<double> ewma;
+  double lastUpdate;
+  atomic_flag lock = ATOMIC_FLAG_INIT;
+
+  HealthWindow window;
+
+  // Guarded by the balancer's writeMutex
+  HealthState health;
+  int ejections;
+  double ejectedUntil;
+};
+
+// Picks never lock. Membership is an immutable server array behind an
+// atomic pointer, replaced whole by add and remove and reclaimed RCU style:
+// a pick counts itself in its thread's stripe while it reads the array, and
+// a writer frees the old array once those counts drain. Random numbers come
+// from a thread local generator. add and remove are serialized by a mutex.
+//
+// With outlier ejection enabled every release also lands in the server's
+// sliding window, and checkHealth, called periodically, ejects servers with
+// too many errors or too much latency by republishing the array without
+// them. Ejections back off exponentially and end in probation, where the
+// server shares probeFraction of the picks with the others on probation
+// until its window decides between reinstating and ejecting it again.
 class LoadBalancer {
 public:
-  LoadBalancer() { }
+  // A request in flight on the picked server. Releasing it, explicitly or
+  // when it goes out of scope, takes it off the server's outstanding count
+  // and feeds its latency into the server's EWMA and its outcome into the
+  // server's health window. Handles must not outlive the balancer.
+  class Handle {
+  public:
+    Handle() : balancer(nullptr), load(nullptr), start(0) { }
+
+    Handle(Handle&& other) : balancer(other.balancer), load(other.load), start(other.start) {
+      other.load = nullptr;
+    }
+
+    Handle& operator=(Handle&& other) {
+      if (this != &other) {
+        release();
+        balancer = other.balancer;
+        load = other.load;
+        start = other.start;
+        other.load = nullptr;
+      }
+
+      return *this;
+    }
+
+    ~Handle() {
+      release();
+    }
+
+    // Picked server id, -1 if the cluster was empty
+    int server() const {
+      return load ? load->id : -1;
+    }
+
+    void release(bool success = true) {
+      if (load) {
+        balancer->complete(*load, start, success);
+        load = nullptr;
+      }
+    }
+
+  private:
+    friend class LoadBalancer;
+
+    Handle(LoadBalancer* balancer, ServerLoad* load, double start) : balancer(balancer), load(load), start(start) {
+      load->outstanding.fetch_add(1, memory_order_relaxed);
+    }
+
+    LoadBalancer* balancer;
+    ServerLoad* load;
+    double start;
+  };
+
+  // decay is the time constant of the latency EWMA, in clock seconds
+  LoadBalancer(PickMode mode = RANDOM, Clock clock = steadySeconds, double decay = 10)
+    : mode(mode), clock(clock), decay(decay), ejecting(false), probeThreshold(0),
+      current(new ServerSet()), phase(0), ejectionTotal(0) { }
+
+  ~LoadBalancer() {
+    delete current.load();
+  }
   
+  // weight only matters to LEAST_OUTSTANDING and WEIGHTED, where a server
+  // weighing zero or less gets no picks unless they all do
+  void add(int serverId, double weight = 1) {
+    add({{serverId, weight}});
+  }
+
+  // Add (id, weight) pairs with a single republish, so filling a large
+  // cluster costs one copy and one alias table build
+  void add(const vector<pair<int, double>>& servers) {
+    lock_guard<mutex> lock(writeMutex);
+
+    for (auto& server: servers) {
+      if (serverToIndex.count(server.first)) {
+        continue;
+      }
+
+      // Counters of a removed server are kept, so its outstanding handles
+      // stay valid and it resumes with them if it is added back
+      unique_ptr<ServerLoad>& load = loads[server.first];
+
+      if (!load) {
+        load.reset(new ServerLoad(server.first, server.second));
+      }
+
+      load->weight.store(server.second, memory_order_relaxed);
+      serverToIndex[server.first] = members.size();
+      members.push_back(load.get());
+    }
+
+    publish();
+  }
+
+  void remove(int serverId) {
+    lock_guard<mutex> lock(writeMutex);
+
+    if (!serverToIndex.count(serverId)) {
+      return;
+    }
+
+    int index = serverToIndex[serverId];
+    ServerLoad* endServer = members.back();
+
+    members[index] = endServer;
+    serverToIndex[endServer->id] = index;
+    serverToIndex.erase(serverId);
+    members.pop_back();
+    publish();
+  }
+
+  void setWeight(int serverId, double weight) {
+    lock_guard<mutex> lock(writeMutex);
+    auto it = loads.find(serverId);
+
+    if (it == loads.end()) {
+      return;
+    }
+
+    it->second->weight.store(weight, memory_order_relaxed);
+
+    if (serverToIndex.count(serverId)) {
+      publish();
+    }
+  }
+
+  // Start recording outcomes for checkHealth. Call before picks start.
+  void enableOutlierEjection(const HealthPolicy& policy = HealthPolicy()) {
+    this->policy = policy;
+    ejecting = true;
+    probeThreshold = (uint32_t) min(4294967295.0, policy.probeFraction * 4294967296.0);
+  }
+
+  // Judge every server on its window: eject healthy ones over the error rate
+  // or, with latencyFactor set, slower than latencyFactor times the median
+  // healthy server; move expired ejections to probation; and reinstate or
+  // re-eject servers on probation once they have enough requests
+  void checkHealth() {
+    lock_guard<mutex> lock(writeMutex);
+
+    if (!ejecting) {
+      return;
+    }
+
+    double now = clock();
+    uint64_t bucket = bucketOf(now);
+    size_t n = members.size();
+    vector<HealthWindow::Totals> totals(n);
+    vector<double> means;
+    size_t unhealthy = 0;
+
+    for (size_t i = 0; i < n; i++) {
+      totals[i] = members[i]->window.read(bucket);
+
+      if (members[i]->health != HEALTHY) {
+        unhealthy++;
+      } else if (totals[i].requests >= policy.minRequests) {
+        means.push_back(totals[i].latency / totals[i].requests);
+      }
+    }
+
+    double median = 0;
+
+    if (!means.empty()) {
+      nth_element(means.begin(), means.begin() + means.size() / 2, means.end());
+      median = means[means.size() / 2];
+    }
+
+    auto outlier = [&](const HealthWindow::Totals& t) {
+      return t.requests >= policy.minRequests &&
+             (t.errors > policy.maxErrorRate * t.requests ||
+              (policy.latencyFactor > 0 && t.latency > policy.latencyFactor * median * t.requests));
+    };
+
+    bool changed = false;
+
+    for (size_t i = 0; i < n; i++) {
+      ServerLoad& load = *members[i];
+
+      switch (load.health) {
+      case HEALTHY:
+        if (outlier(totals[i]) && unhealthy + 1 <= policy.maxEjectedShare * n) {
+          eject(load, now);
+          unhealthy++;
+          changed = true;
+        }
+
+        break;
+      case EJECTED:
+        if (now >= load.ejectedUntil) {
+          load.health = PROBING;
+          changed = true;
+        }
+
+        break;
+      case PROBING:
+        if (totals[i].requests >= policy.minRequests) {
+          if (outlier(totals[i])) {
+            eject(load, now);
+          } else {
+            load.health = HEALTHY;
+            load.ejections = 0;
+          }
+
+          changed = true;
+        }
+
+        break;
+      }
+    }
+
+    if (changed) {
+      publish();
+    }
+  }
+
+  size_t ejectionCount() const {
+    return ejectionTotal.load();
+  }
+
+  // Wait-free: a fixed number of steps whatever add, remove and checkHealth
+  // are doing
+  Handle pick() {
+    ReaderCount& readers = readerCounts[readerStripe()];
+    unsigned parity = phase.load() & 1;
+
+    readers.active[parity].fetch_add(1);
+
+    const ServerSet& set = *current.load();
+    ServerLoad* load = nullptr;
+
+    if (!set.probing.empty() && (set.servers.empty() || (uint32_t) fastRandom() < probeThreshold)) {
+      load = set.probing[randomBelow(set.probing.size())];
+    } else if (!set.servers.empty()) {
+      load = choose(set);
+    }
+
+    // choose never returns null, so load is null only with no servers at all
+    Handle handle = load ? Handle(this, load, mode == PEAK_EWMA || ejecting ? clock() : 0) : Handle();
+
+    readers.active[parity].fetch_sub(1);
+
+    return handle;
+  }
+
+private:
+  // Slot of a Vose alias table: a uniformly drawn slot picks its own server
+  // when a 32-bit coin falls below threshold and its alias otherwise
+  struct AliasEntry {
+    uint32_t threshold;
+    uint32_t self;
+    uint32_t alias;
+  };
+
+  // Servers seen by pick, healthy ones and those on probation. It is never
+  // modified: every change publishes a new one and frees the old one after
+  // a grace period.
+  struct ServerSet {
+    vector<ServerLoad*> servers;
+    vector<AliasEntry> aliases;
+    vector<ServerLoad*> probing;
+  };
+
+  ServerLoad* choose(const ServerSet& set) const {
+    const vector<ServerLoad*>& servers = set.servers;
+    size_t n = servers.size();
+    ServerLoad* load = nullptr;
+
+    switch (mode) {
+    case RANDOM:
+      load = servers[randomBelow(n)];
+      break;
+    case TWO_CHOICES:
+    case PEAK_EWMA: {
+      // Two distinct servers
+      size_t i = randomBelow(n), j = i;
+
+      if (n > 1) {
+        j = randomBelow(n - 1);
+        j += j >= i;
+      }
+
+      ServerLoad* a = servers[i];
+      ServerLoad* b = servers[j];
+
+      load = cost(*b) < cost(*a) ? b : a;
+      break;
+    }
+    case LEAST_OUTSTANDING: {
+      // Start at a random server so ties do not all land on the first one
+      size_t first = randomBelow(n);
+      double best = INFINITY;
+
+      for (size_t k = 0; k < n; k++) {
+        ServerLoad* candidate = servers[(first + k) % n];
+        double weight = candidate->weight.load(memory_order_relaxed);
+
+        if (weight <= 0) {
+          continue;
+        }
+
+        double c = (candidate->outstanding.load(memory_order_relaxed) + 1) / weight;
+
+        if (c < best) {
+          best = c;
+          load = candidate;
+        }
+      }
+
+      // All weights zero picks uniformly, as WEIGHTED does
+      if (!load) {
+        load = servers[first];
+      }
+
+      break;
+    }
+    case WEIGHTED: {
+      const AliasEntry& entry = set.aliases[randomBelow(n)];
+
+      load = servers[(uint32_t) fastRandom() < entry.threshold ? entry.self : entry.alias];
+      break;
+    }
+    }
+
+    return load;
+  }
+
+  // Vose's method: scale weights to average 1, then repeatedly top up an
+  // under-full slot with the remainder of an over-full one, which becomes
+  // its alias. O(n); all weights zero picks uniformly.
+  static void buildAliases(ServerSet& set) {
+    size_t n = set.servers.size();
+    vector<double> scaled(n);
+    vector<uint32_t> small, large;
+    double total = 0;
+
+    for (ServerLoad* load: set.servers) {
+      total += max(0.0, load->weight.load(memory_order_relaxed));
+    }
+
+    set.aliases.resize(n);
+
+    for (size_t i = 0; i < n; i++) {
+      double weight = max(0.0, set.servers[i]->weight.load(memory_order_relaxed));
+
+      scaled[i] = total > 0 ? weight * n / total : 1;
+      set.aliases[i] = {0, (uint32_t) i, (uint32_t) i};
+      (scaled[i] < 1 ? small : large).push_back(i);
+    }
+
+    while (!small.empty() && !large.empty()) {
+      uint32_t s = small.back(), l = large.back();
+
+      small.pop_back();
+      set.aliases[s].threshold = (uint32_t) (scaled[s] * 4294967296.0);
+      set.aliases[s].alias = l;
+      scaled[l] -= 1 - scaled[s];
+
+      if (scaled[l] < 1) {
+        large.pop_back();
+        small.push_back(l);
+      }
+    }
+
+    // Whatever is left is full up to rounding and always picks itself
+    for (uint32_t i: small) {
+      set.aliases[i].alias = i;
+    }
+
+    for (uint32_t i: large) {
+      set.aliases[i].alias = i;
+    }
+  }
+
+  // Picks in progress on one stripe of threads, counted separately for each
+  // parity of the phase they started in
+  struct alignas(64) ReaderCount {
+    atomic<long> active[2] = {{0}, {0}};
+  };
+
+  static const size_t READER_STRIPES = 64;
+
+  static size_t readerStripe() {
+    static atomic<size_t> threads(0);
+    thread_local size_t stripe = threads.fetch_add(1) % READER_STRIPES;
+
+    return stripe;
+  }
+
+  // Swap in a server set built from the members, with its alias table ready
+  // before any pick can see it, and free the old one once no pick can still
+  // be reading it. Flipping the phase and draining the old parity twice
+  // covers a pick that read the phase before one flip but counted itself
+  // after it.
+  void publish() {
+    ServerSet* next = new ServerSet();
+
+    for (ServerLoad* load: members) {
+      if (load->health == HEALTHY) {
+        next->servers.push_back(load);
+      } else if (load->health == PROBING) {
+        next->probing.push_back(load);
+      }
+    }
+
+    if (mode == WEIGHTED) {
+      buildAliases(*next);
+    }
+
+    ServerSet* old = current.exchange(next);
+
+    for (int round = 0; round < 2; round++) {
+      unsigned parity = phase.fetch_add(1) & 1;
+
+      for (ReaderCount& readers: readerCounts) {
+        while (readers.active[parity].load() != 0) {
+          this_thread::yield();
+        }
+      }
+    }
+
+    delete old;
+  }
+
+  void eject(ServerLoad& load, double now) {
+    double backoff = policy.baseEjection * pow(2.0, min(load.ejections, 30));
+
+    load.health = EJECTED;
+    load.ejectedUntil = now + min(backoff, policy.maxEjection);
+    load.ejections++;
+    ejectionTotal++;
+  }
+
+  uint64_t bucketOf(double now) const {
+    return (uint64_t) (now / (policy.window / HealthWindow::BUCKETS));
+  }
+
+  // Expected wait on a server for the sampling modes. A server without a
+  // latency sample yet is only preferred while it is idle.
+  double cost(const ServerLoad& load) const {
+    int outstanding = load.outstanding.load(memory_order_relaxed);
+
+    if (mode == TWO_CHOICES) {
+      return outstanding;
+    }
+
+    double ewma = load.ewma.load(memory_order_relaxed);
+
+    return ewma > 0 ? ewma * (outstanding + 1) : outstanding * UNMEASURED_PENALTY;
+  }
+
+  // Peak EWMA: a latency above the average replaces it at once, anything
+  // below decays it with a weight that depends on the time since the last
+  // sample, so a server that just slowed down is avoided straight away
+  void complete(ServerLoad& load, double start, bool success) {
+    load.outstanding.fetch_sub(1, memory_order_relaxed);
+
+    if (mode != PEAK_EWMA && !ejecting) {
+      return;
+    }
+
+    double now = clock();
+    double latency = now - start;
+
+    if (ejecting) {
+      load.window.record(bucketOf(now), success, latency);
+    }
+
+    if (mode != PEAK_EWMA) {
+      return;
+    }
+
+    while (load.lock.test_and_set(memory_order_acquire)) {
+    }
+
+    double ewma = load.ewma.load(memory_order_relaxed);
+
+    if (latency > ewma) {
+      ewma = latency;
+    } else {
+      double w = exp(-(now - load.lastUpdate) / decay);
+
+      ewma = ewma * w + latency * (1 - w);
+    }
+
+    load.lastUpdate = now;
+    load.ewma.store(ewma, memory_order_relaxed);
+    load.lock.clear(memory_order_release);
+  }
+
+  static constexpr double UNMEASURED_PENALTY = 1e6;
+
+  PickMode mode;
+  Clock clock;
+  double decay;
+  bool ejecting;
+  HealthPolicy policy;
+  uint32_t probeThreshold;
+
+  atomic<ServerSet*> current;
+  atomic<unsigned> phase;
+  ReaderCount readerCounts[READER_STRIPES];
+  atomic<size_t> ejectionTotal;
+
+  // Guarded by writeMutex
+  mutex writeMutex;
+  unordered_map<int, unique_ptr<ServerLoad>> loads;
+  unordered_map<int, int> serverToIndex;
+  vector<ServerLoad*> members;
+};
+
+// Original design behind a mutex, kept as the concurrency benchmark baseline
+class LockedLoadBalancer {
+public:
   void add(int serverId) {
+    lock_guard<mutex> lock(mtx);
+
     if (serverToIndex.count(serverId)) {
       return;
     }
@@ -57,7 +725,9 @@ public:
   }
 
   void remove(int serverId) {
-    if (serverToIndex.count(serverId)) {
+    lock_guard<mutex> lock(mtx);
+
+    if (!serverToIndex.count(serverId)) {
       return;
     }
 
@@ -71,33 +741,352 @@ public:
   }
 
   int pick() {
-    int index = random() % indexToServer.size();
+    lock_guard<mutex> lock(mtx);
 
-    return indexToServer[index];
+    return indexToServer.empty() ? -1 : indexToServer[random() % indexToServer.size()];
   }
 
 private:
+  mutex mtx;
   unordered_map<int, int> serverToIndex;
   vector<int> indexToServer;
 };
 
-int main() {
+// Simulated time, advanced by the benchmark's event loop
+double simulatedNow = 0;
+
+double simulatedSeconds() {
+  return simulatedNow;
+}
+
+// Discrete event simulation of 32 single-worker FIFO servers, a quarter of
+// them four times slower than the rest, under Poisson arrivals at 80% of
+// total capacity. Service times are exponential. Each request holds its
+// handle until it completes and reports completion latency in ms.
+void benchmarkModes() {
+  const int servers = 32;
+  const int requests = 200000;
+  const char* names[] = {"random", "two choices", "least outstanding", "peak ewma", "weighted"};
+  vector<double> speeds(servers);
+  double capacity = 0;
+
+  for (int s = 0; s < servers; s++) {
+    speeds[s] = s % 4 == 0 ? 250 : 1000;
+    capacity += speeds[s];
+  }
+
+  for (PickMode mode: {RANDOM, TWO_CHOICES, LEAST_OUTSTANDING, PEAK_EWMA, WEIGHTED}) {
+    LoadBalancer loadBalancer(mode, simulatedSeconds, 0.1);
+    mt19937 rng(1);
+    exponential_distribution<double> arrival(0.8 * capacity);
+    vector<double> busyUntil(servers, 0);
+    vector<LoadBalancer::Handle> inFlight(requests);
+    vector<double> arrivedAt(requests), latencies;
+
+    // Completion events as (time, request)
+    priority_queue<pair<double, int>, vector<pair<double, int>>, greater<pair<double, int>>> completions;
+    double nextArrival = 0;
+
+    simulatedNow = 0;
+
+    for (int s = 0; s < servers; s++) {
+      loadBalancer.add(s, speeds[s]);
+    }
+
+    for (int r = 0; r < requests || !completions.empty(); ) {
+      if (r < requests && (completions.empty() || nextArrival < completions.top().first)) {
+        simulatedNow = nextArrival;
+        inFlight[r] = loadBalancer.pick();
+
+        int s = inFlight[r].server();
+        double finish = max(simulatedNow, busyUntil[s]) + exponential_distribution<double>(speeds[s])(rng);
+
+        busyUntil[s] = finish;
+        completions.push({finish, r});
+        arrivedAt[r] = simulatedNow;
+        nextArrival += arrival(rng);
+        r++;
+      } else {
+        int done = completions.top().second;
+
+        simulatedNow = completions.top().first;
+        completions.pop();
+        latencies.push_back(simulatedNow - arrivedAt[done]);
+        inFlight[done].release();
+      }
+    }
+
+    sort(latencies.begin(), latencies.end());
+
+    cout << names[mode] << " p50 " << latencies[requests / 2] * 1e3 << " ms"
+         << " p99 " << latencies[requests * 99 / 100] * 1e3 << " ms" << endl;
+  }
+}
+
+// Picks/sec from 1 up to all cores over 1000 servers while another thread
+// keeps removing and re-adding servers
+template <class Balancer, class Pick>
+void benchmarkConcurrentPicks(const char* name, Pick pick) {
+  int cores = max(1u, thread::hardware_concurrency());
+
+  for (int threads = 1; ; threads = min(threads * 2, cores)) {
+    Balancer loadBalancer;
+    atomic<bool> done(false);
+    atomic<long> picks(0), changes(0);
+
+    for (int s = 0; s < 1000; s++) {
+      loadBalancer.add(s);
+    }
+
+    thread churn([&] {
+      for (int s = 0; !done.load(); s = (s + 1) % 1000) {
+        loadBalancer.remove(s);
+        loadBalancer.add(s);
+        changes += 2;
+        this_thread::sleep_for(chrono::microseconds(100));
+      }
+    });
+
+    vector<thread> pickers;
+
+    for (int t = 0; t < threads; t++) {
+      pickers.emplace_back([&] {
+        long local = 0;
+        int sink = 0;
+
+        while (!done.load(memory_order_relaxed)) {
+          for (int i = 0; i < 1000; i++) {
+            sink ^= pick(loadBalancer);
+          }
+
+          local += 1000;
+        }
+
+        picks += local + (sink == INT_MIN);
+      });
+    }
+
+    this_thread::sleep_for(chrono::milliseconds(500));
+    done = true;
+
+    for (thread& picker: pickers) {
+      picker.join();
+    }
+
+    churn.join();
+
+    cout << name << " threads=" << threads << " " << picks / 0.5 / 1e6 << " M picks/s, "
+         << changes / 0.5 << " membership changes/s" << endl;
+
+    if (threads == cores) {
+      break;
+    }
+  }
+}
+
+// 32 equal servers under two choices at 70% load for 10 s of simulated time.
+// From t = 2 s four of them fail fast, answering in 0.1 ms with an error 90%
+// of the time, which two choices alone rewards with more traffic; two of
+// them recover at t = 6 s. checkHealth runs every 100 ms.
+void benchmarkEjection() {
+  const int servers = 32;
+  const double speed = 1000, duration = 10;
+
+  for (bool eject: {false, true}) {
+    LoadBalancer loadBalancer(TWO_CHOICES, simulatedSeconds);
+    HealthPolicy policy;
+    mt19937 rng(3);
+    exponential_distribution<double> arrival(0.7 * servers * speed);
+    uniform_real_distribution<double> coin(0, 1);
+    vector<double> busyUntil(servers, 0);
+    vector<LoadBalancer::Handle> inFlight;
+    vector<double> arrivedAt, latencies;
+    vector<bool> failed;
+
+    // Completion events as (time, request)
+    priority_queue<pair<double, int>, vector<pair<double, int>>, greater<pair<double, int>>> completions;
+    double nextArrival = 0, nextCheck = 0.1;
+    long errors = 0;
+
+    policy.window = 1;
+    policy.baseEjection = 1;
+    policy.maxEjection = 8;
+
+    if (eject) {
+      loadBalancer.enableOutlierEjection(policy);
+    }
+
+    simulatedNow = 0;
+
+    for (int s = 0; s < servers; s++) {
+      loadBalancer.add(s);
+    }
+
+    while (nextArrival < duration || !completions.empty()) {
+      double next = min(nextArrival < duration ? nextArrival : INFINITY, nextCheck);
+
+      if (!completions.empty() && completions.top().first <= next) {
+        int done = completions.top().second;
+
+        simulatedNow = completions.top().first;
+        completions.pop();
+        latencies.push_back(simulatedNow - arrivedAt[done]);
+        errors += failed[done];
+        inFlight[done].release(!failed[done]);
+      } else if (next == nextCheck) {
+        simulatedNow = nextCheck;
+        nextCheck = nextArrival < duration ? nextCheck + 0.1 : INFINITY;
+        loadBalancer.checkHealth();
+      } else {
+        simulatedNow = nextArrival;
+        inFlight.push_back(loadBalancer.pick());
+
+        int s = inFlight.back().server();
+        bool faulty = s < 4 && simulatedNow >= 2 && (s >= 2 || simulatedNow < 6);
+        double service = faulty ? 0.0001 : exponential_distribution<double>(speed)(rng);
+        double finish = max(simulatedNow, busyUntil[s]) + service;
+
+        busyUntil[s] = finish;
+        completions.push({finish, (int) arrivedAt.size()});
+        arrivedAt.push_back(simulatedNow);
+        failed.push_back(faulty && coin(rng) < 0.9);
+        nextArrival += arrival(rng);
+      }
+    }
+
+    sort(latencies.begin(), latencies.end());
+
+    cout << (eject ? "with ejection   " : "without ejection")
+         << " error rate " << 100.0 * errors / latencies.size() << "%"
+         << " p99 " << latencies[latencies.size() * 99 / 100] * 1e3 << " ms"
+         << " ejections " << loadBalancer.ejectionCount() << endl;
+  }
+
+  // Pick plus release cost on the real clock
+  for (bool eject: {false, true}) {
+    LoadBalancer loadBalancer(TWO_CHOICES);
+    const int picks = 5000000;
+
+    if (eject) {
+      loadBalancer.enableOutlierEjection();
+    }
+
+    for (int s = 0; s < servers; s++) {
+      loadBalancer.add(s);
+    }
+
+    auto start = chrono::steady_clock::now();
+
+    for (int i = 0; i < picks; i++) {
+      loadBalancer.pick().release(i % 100 != 0);
+    }
+
+    double secs = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+    cout << (eject ? "with ejection   " : "without ejection") << " pick+release "
+         << secs / picks * 1e9 << " ns" << endl;
+  }
+}
+
+// Weighted pick throughput against uniform and the cost of one weight change,
+// which republishes the server array with a fresh alias table, from 10 to
+// 100K servers of four machine generations weighted 1 to 4
+void benchmarkWeighted() {
+  for (int n = 10; n <= 100000; n *= 10) {
+    LoadBalancer uniform(RANDOM), weighted(WEIGHTED);
+    vector<pair<int, double>> servers;
+
+    for (int s = 0; s < n; s++) {
+      servers.push_back({s, 1 + s % 4});
+    }
+
+    uniform.add(servers);
+    weighted.add(servers);
+
+    const int picks = 5000000;
+    vector<int> counts(n);
+    auto start = chrono::steady_clock::now();
+
+    for (int i = 0; i < picks; i++) {
+      uniform.pick();
+    }
+
+    auto mid = chrono::steady_clock::now();
+
+    for (int i = 0; i < picks; i++) {
+      counts[weighted.pick().server()]++;
+    }
+
+    auto end = chrono::steady_clock::now();
+    const int rebuilds = max(10, 1000000 / n);
+
+    for (int i = 0; i < rebuilds; i++) {
+      weighted.setWeight(i % n, 1 + (i + 1) % 4);
+    }
+
+    auto rebuilt = chrono::steady_clock::now();
+
+    // Largest gap between a generation's share of picks and of total weight
+    double picked[4] = {0}, weights[4] = {0}, totalWeight = 0, error = 0;
+
+    for (int s = 0; s < n; s++) {
+      picked[s % 4] += (double) counts[s] / picks;
+      weights[s % 4] += servers[s].second;
+      totalWeight += servers[s].second;
+    }
+
+    for (int g = 0; g < 4; g++) {
+      error = max(error, fabs(picked[g] - weights[g] / totalWeight));
+    }
+
+    cout << "servers=" << n
+         << " uniform " << picks / chrono::duration<double>(mid - start).count() / 1e6 << " M picks/s"
+         << " weighted " << picks / chrono::duration<double>(end - mid).count() / 1e6 << " M picks/s"
+         << " (share error " << error << ")"
+         << " rebuild " << chrono::duration<double>(rebuilt - end).count() / rebuilds * 1e6 << " us" << endl;
+  }
+}
+
+void benchmark() {
+  benchmarkModes();
+  benchmarkWeighted();
+  benchmarkEjection();
+  benchmarkConcurrentPicks<LockedLoadBalancer>("mutex+random() ", [](LockedLoadBalancer& lb) {
+    return lb.pick();
+  });
+  benchmarkConcurrentPicks<LoadBalancer>("rcu random     ", [](LoadBalancer& lb) {
+    return lb.pick().server();
+  });
+}
+
+int main(int argc, char* argv[]) {
   LoadBalancer loadBalancer;
 
   loadBalancer.add(1);
   loadBalancer.add(2);
   loadBalancer.add(3);
 
-  cout << "pick " << loadBalancer.pick() << endl;
-  cout << "pick " << loadBalancer.pick() << endl;
-  cout << "pick " << loadBalancer.pick() << endl;
-  cout << "pick " << loadBalancer.pick() << endl;
+  cout << "pick " << loadBalancer.pick().server() << endl;
+  cout << "pick " << loadBalancer.pick().server() << endl;
+  cout << "pick " << loadBalancer.pick().server() << endl;
+  cout << "pick " << loadBalancer.pick().server() << endl;
 
   loadBalancer.remove(1);
 
-  cout << "pick " << loadBalancer.pick() << endl;
-  cout << "pick " << loadBalancer.pick() << endl;
-  cout << "pick " << loadBalancer.pick() << endl;
-}
+  cout << "pick " << loadBalancer.pick().server() << endl;
+  cout << "pick " << loadBalancer.pick().server() << endl;
+  cout << "pick " << loadBalancer.pick().server() << endl;
+
+  LoadBalancer unweighted(LEAST_OUTSTANDING);
 
+  unweighted.add({{1, 0}, {2, 0}});
 
+  int zeroPick = unweighted.pick().server();
+
+  cout << "zero weights pick " << zeroPick << endl;
+  assert(zeroPick == 1 || zeroPick == 2);
+
+  if (argc > 1 && string(argv[1]) == "bench") {
+    benchmark();
+  }
+}
@@ -25,56 +25,2889 @@ query("google", 0, 1)
 #include <map>
 #include <set>
 #include <string>
+#include <string_view>
 #include <list>
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <chrono>
+#include <random>
+#include <queue>
+#include <functional>
+#include <cstdint>
+#include <cstring>
+#include <cstdio>
+#include <cstdlib>
+#include <ctime>
 #include <algorithm>
+#include <numeric>
 #include <iostream>
 #include <iterator>
 #include <sstream> 
+#include <fstream>
 #include <cassert>
 #include <climits>
 
+#include <dirent.h>
+#include <fcntl.h>
+#include <malloc.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
 using namespace std;
 
-class Cassandra {
+uint32_t unixSeconds() {
+  return (uint32_t) time(nullptr);
+}
+
+struct CassandraOptions {
+  size_t memtableBytes = 4 << 20;  // memtable size that triggers a flush
+  size_t blockSize = 4096;         // target size of an SSTable data block
+  size_t mergeFactor = 4;          // tables in one tier that trigger a compaction
+  bool syncWrites = false;         // fdatasync the log before insert returns
+  size_t blockCacheBytes = 8 << 20;  // shared cache of data, index and filter blocks
+  int bloomBitsPerKey = 10;        // row key filter size per table, 0 for none
+  size_t queryThreads = thread::hardware_concurrency();  // multiQuery threads, caller included
+  bool compression = true;         // LZ compress data blocks that shrink by 1/8 or more
+  uint32_t (*clock)() = unixSeconds;  // seconds for TTLs
+};
+
+// One insert of a batch
+struct Mutation {
+  string rowKey;
+  int columnKey;
+  string value;
+  uint32_t ttlSeconds = 0;  // 0 for no expiry
+};
+
+// Fixed set of worker threads running queued tasks
+class ThreadPool {
 public:
-  void insert(string rowKey, int columnKey, string value) {
-    database[rowKey][columnKey] = value;
+  ThreadPool(size_t threads) : stopping(false) {
+    for (size_t i = 0; i < threads; i++) {
+      workers.emplace_back(&ThreadPool::run, this);
+    }
   }
 
-  vector<pair<int, string>> query(string rowKey, int columnKey1, int columnKey2) {
-    assert(columnKey1 <= columnKey2);  
+  ~ThreadPool() {
+    {
+      lock_guard<mutex> lock(mtx);
+      stopping = true;
+    }
 
-    auto itRow = database.find(rowKey);
+    cv.notify_all();
 
-    if (itRow == database.end()) {
-      return { };
+    for (thread& worker: workers) {
+      worker.join();
     }
+  }
 
-    auto itCol = itRow->second.lower_bound(columnKey1);
+  void submit(function<void()> task) {
+    {
+      lock_guard<mutex> lock(mtx);
+      tasks.push(move(task));
+    }
 
-    vector<pair<int, string>> result;
+    cv.notify_one();
+  }
+
+  size_t size() const {
+    return workers.size();
+  }
+
+private:
+  void run() {
+    while (true) {
+      function<void()> task;
+
+      {
+        unique_lock<mutex> lock(mtx);
+
+        cv.wait(lock, [this] { return stopping || !tasks.empty(); });
+
+        if (tasks.empty()) {
+          return;
+        }
 
-    while (itCol != itRow->second.end() && itCol->first <= columnKey2) {
-      result.push_back({itCol->first, itCol->second});
-      ++itCol;
+        task = move(tasks.front());
+        tasks.pop();
+      }
+
+      task();
     }
+  }
 
-    return result;
+  mutex mtx;
+  condition_variable cv;
+  queue<function<void()>> tasks;
+  bool stopping;
+  vector<thread> workers;
+};
+
+// Disk errors are not recoverable here: stop rather than lose writes
+void checkIo(bool ok, const char* what) {
+  if (!ok) {
+    perror(what);
+    abort();
+  }
+}
+
+bool writeAll(int fd, const char* data, size_t n) {
+  while (n > 0) {
+    ssize_t written = write(fd, data, n);
+
+    if (written < 0) {
+      return false;
+    }
+
+    data += written;
+    n -= written;
+  }
+
+  return true;
+}
+
+// fsync a file or directory by path, so its contents or entries are durable
+bool syncPath(const string& path) {
+  int fd = ::open(path.c_str(), O_RDONLY);
+  bool ok = fd >= 0 && fsync(fd) == 0;
+
+  if (fd >= 0) {
+    close(fd);
+  }
+
+  return ok;
+}
+
+// CRC-32 (IEEE), guards log records against torn writes
+uint32_t crc32(const char* data, size_t n) {
+  static const vector<uint32_t> table = [] {
+    vector<uint32_t> t(256);
+
+    for (uint32_t i = 0; i < 256; i++) {
+      uint32_t c = i;
+
+      for (int k = 0; k < 8; k++) {
+        c = c & 1 ? 0xedb88320 ^ (c >> 1) : c >> 1;
+      }
+
+      t[i] = c;
+    }
+
+    return t;
+  }();
+
+  uint32_t crc = 0xffffffff;
+
+  for (size_t i = 0; i < n; i++) {
+    crc = table[(crc ^ (uint8_t) data[i]) & 0xff] ^ (crc >> 8);
+  }
+
+  return ~crc;
+}
+
+void appendVarint(string& out, uint64_t value) {
+  while (value >= 0x80) {
+    out += (char) (value | 0x80);
+    value >>= 7;
+  }
+
+  out += (char) value;
+}
+
+// Read a varint ending before end, false if it does not
+bool readVarint(const char*& p, const char* end, uint64_t& value) {
+  value = 0;
+
+  for (int shift = 0; p < end && shift < 64; shift += 7) {
+    uint8_t byte = *p++;
+
+    value |= (uint64_t) (byte & 0x7f) << shift;
+
+    if (byte < 0x80) {
+      return true;
+    }
+  }
+
+  return false;
+}
+
+void appendFixed32(string& out, uint32_t value) {
+  out.append(reinterpret_cast<const char*>(&value), 4);
+}
+
+void appendFixed64(string& out, uint64_t value) {
+  out.append(reinterpret_cast<const char*>(&value), 8);
+}
+
+uint32_t readFixed32(const char* p) {
+  uint32_t value;
+
+  memcpy(&value, p, 4);
+
+  return value;
+}
+
+uint64_t readFixed64(const char* p) {
+  uint64_t value;
+
+  memcpy(&value, p, 8);
+
+  return value;
+}
+
+// Order of (rowKey, columnKey) in memtables and SSTables
+inline int compareKeys(string_view rowA, int columnA, string_view rowB, int columnB) {
+  int c = rowA.compare(rowB);
+
+  return c != 0 ? c : columnA < columnB ? -1 : columnA > columnB;
+}
+
+// 64-bit FNV-1a with a murmur finalizer, for Bloom filters
+uint64_t hashKey(string_view key) {
+  uint64_t h = 14695981039346656037ULL;
+
+  for (char c: key) {
+    h = (h ^ (uint8_t) c) * 1099511628211ULL;
+  }
+
+  h ^= h >> 33;
+  h *= 0xff51afd7ed558ccdULL;
+  h ^= h >> 33;
+
+  return h;
+}
+
+const size_t LZ_MIN_MATCH = 4;
+const int LZ_HASH_BITS = 13;
+
+// Append a length nibble's overflow: bytes of 255 and a final smaller one
+void appendLzLength(string& out, size_t length) {
+  for (; length >= 255; length -= 255) {
+    out += (char) 255;
+  }
+
+  out += (char) length;
+}
+
+// LZ77 compression in the LZ4 style: sequences of a token (literal count
+// and match length - 4, four bits each, 15 meaning more length bytes
+// follow), the literals and a 2 byte match offset, ending with a sequence
+// of literals only. Matches are found through a hash table of 4 byte
+// prefixes; the search step grows over incompressible stretches.
+string lzCompress(string_view in) {
+  uint32_t table[1 << LZ_HASH_BITS] = {};
+  string out;
+  size_t anchor = 0, i = 0, n = in.size();
+
+  out.reserve(n / 2);
+
+  while (i + LZ_MIN_MATCH <= n) {
+    uint32_t prefix = readFixed32(in.data() + i);
+    uint32_t h = prefix * 2654435761u >> (32 - LZ_HASH_BITS);
+    size_t candidate = table[h];
+
+    table[h] = i + 1;
+
+    if (candidate == 0 || i - (candidate - 1) > 65535 || readFixed32(in.data() + candidate - 1) != prefix) {
+      i += 1 + ((i - anchor) >> 6);
+      continue;
+    }
+
+    size_t match = candidate - 1, length = LZ_MIN_MATCH, literals = i - anchor;
+
+    while (i + length < n && in[match + length] == in[i + length]) {
+      length++;
+    }
+
+    out += (char) (min<size_t>(literals, 15) << 4 | min<size_t>(length - LZ_MIN_MATCH, 15));
+
+    if (literals >= 15) {
+      appendLzLength(out, literals - 15);
+    }
+
+    out.append(in.data() + anchor, literals);
+    out += (char) (i - match);
+    out += (char) ((i - match) >> 8);
+
+    if (length - LZ_MIN_MATCH >= 15) {
+      appendLzLength(out, length - LZ_MIN_MATCH - 15);
+    }
+
+    i += length;
+    anchor = i;
+  }
+
+  size_t literals = n - anchor;
+
+  out += (char) (min<size_t>(literals, 15) << 4);
+
+  if (literals >= 15) {
+    appendLzLength(out, literals - 15);
+  }
+
+  out.append(in.data() + anchor, literals);
+
+  return out;
+}
+
+// Read a length nibble's overflow, false past the end
+bool readLzLength(const uint8_t*& p, const uint8_t* end, size_t& length) {
+  uint8_t byte;
+
+  do {
+    if (p == end) {
+      return false;
+    }
+
+    byte = *p++;
+    length += byte;
+  } while (byte == 255);
+
+  return true;
+}
+
+// Decode lzCompress output of size bytes into out, false if it is corrupt
+bool lzDecompress(string_view in, size_t size, string& out) {
+  const uint8_t* p = (const uint8_t*) in.data();
+  const uint8_t* end = p + in.size();
+  size_t written = 0;
+
+  out.resize(size);
+
+  while (p < end) {
+    uint8_t token = *p++;
+    size_t literals = token >> 4;
+
+    if ((literals == 15 && !readLzLength(p, end, literals)) || literals > (size_t) (end - p) ||
+        literals > size - written) {
+      return false;
+    }
+
+    memcpy(&out[written], p, literals);
+    p += literals;
+    written += literals;
+
+    if (p == end) {
+      break;
+    }
+
+    if (end - p < 2) {
+      return false;
+    }
+
+    size_t offset = p[0] | p[1] << 8, length = (token & 15) + LZ_MIN_MATCH;
+
+    p += 2;
+
+    if ((length == 15 + LZ_MIN_MATCH && !readLzLength(p, end, length)) || offset == 0 || offset > written ||
+        length > size - written) {
+      return false;
+    }
+
+    char* dst = &out[written];
+
+    if (offset >= length) {
+      memcpy(dst, dst - offset, length);
+    } else {
+      for (size_t k = 0; k < length; k++) {
+        dst[k] = dst[k - offset];
+      }
+    }
+
+    written += length;
+  }
+
+  return written == size;
+}
+
+// Blocked Bloom filter: every key sets all of its bits in one 64 byte
+// block, so a lookup costs a single cache miss. The last byte holds the
+// number of probes; an empty filter matches everything.
+class BloomFilter {
+public:
+  static string build(const vector<uint64_t>& hashes, int bitsPerKey) {
+    if (hashes.empty() || bitsPerKey <= 0) {
+      return "";
+    }
+
+    size_t blocks = (hashes.size() * bitsPerKey + 511) / 512;
+    int probes = max(1, min(12, (int) (bitsPerKey * 0.69)));
+    string filter(blocks * 64 + 1, 0);
+
+    for (uint64_t hash: hashes) {
+      char* block = &filter[blockOf(hash, blocks) * 64];
+      uint32_t h = (uint32_t) hash, delta = h >> 17 | h << 15;
+
+      for (int i = 0; i < probes; i++, h += delta) {
+        block[(h & 511) >> 3] |= 1 << (h & 7);
+      }
+    }
+
+    filter.back() = (char) probes;
+
+    return filter;
+  }
+
+  static bool mayContain(string_view filter, uint64_t hash) {
+    if (filter.size() < 65) {
+      return true;
+    }
+
+    size_t blocks = (filter.size() - 1) / 64;
+    const char* block = filter.data() + blockOf(hash, blocks) * 64;
+    uint32_t h = (uint32_t) hash, delta = h >> 17 | h << 15;
+
+    for (int i = 0; i < filter.back(); i++, h += delta) {
+      if (!(block[(h & 511) >> 3] & 1 << (h & 7))) {
+        return false;
+      }
+    }
+
+    return true;
   }
 
 private:
-  unordered_map<string, map<int, string>> database;
+  static size_t blockOf(uint64_t hash, size_t blocks) {
+    return (size_t) ((hash >> 32) * blocks >> 32);
+  }
 };
 
-int main() {
-  Cassandra cassandra;
+// LRU cache of data blocks shared by every table, keyed by file number
+// and block offset and split into shards with their own locks so readers
+// of different blocks rarely wait for each other. Index and filter blocks
+// are pinned: they count against the capacity but are never evicted while
+// their table is open.
+class BlockCache {
+public:
+  BlockCache(size_t capacity) : capacity(capacity), pinned(0), misses(0) { }
 
-  cassandra.insert("google", 1, "haha");
-  
-  auto result = cassandra.query("google", 0, 1);
+  shared_ptr<const string> lookup(uint64_t file, uint64_t offset) {
+    uint64_t key = keyOf(file, offset);
+    Shard& shard = shardOf(key);
+    lock_guard<mutex> lock(shard.mtx);
+    auto it = shard.entries.find(key);
 
-  for (auto& r: result) {
-    cout << "col " << r.first << " value " << r.second << endl;
+    if (it == shard.entries.end()) {
+      return nullptr;
+    }
+
+    shard.lru.splice(shard.lru.begin(), shard.lru, it->second);
+
+    return it->second->block;
+  }
+
+  void insert(uint64_t file, uint64_t offset, shared_ptr<const string> block) {
+    uint64_t key = keyOf(file, offset);
+    Shard& shard = shardOf(key);
+    size_t limit = (capacity - min(capacity, pinned.load())) / SHARDS;
+    lock_guard<mutex> lock(shard.mtx);
+
+    if (block->size() > limit || shard.entries.count(key)) {
+      return;
+    }
+
+    shard.lru.push_front({key, block});
+    shard.entries[key] = shard.lru.begin();
+    shard.used += block->size();
+
+    while (shard.used > limit) {
+      shard.used -= shard.lru.back().block->size();
+      shard.entries.erase(shard.lru.back().key);
+      shard.lru.pop_back();
+    }
+  }
+
+  void pin(size_t bytes) {
+    pinned += bytes;
+  }
+
+  void unpin(size_t bytes) {
+    pinned -= bytes;
+  }
+
+  // Blocks read from disk on a cache miss
+  void countMiss() {
+    misses++;
+  }
+
+  size_t missCount() const {
+    return misses.load();
+  }
+
+private:
+  static const size_t SHARDS = 16;
+
+  struct Entry {
+    uint64_t key;
+    shared_ptr<const string> block;
+  };
+
+  struct Shard {
+    mutex mtx;
+    list<Entry> lru;
+    unordered_map<uint64_t, list<Entry>::iterator> entries;
+    size_t used = 0;
+  };
+
+  static uint64_t keyOf(uint64_t file, uint64_t offset) {
+    return file << 40 | offset;
+  }
+
+  Shard& shardOf(uint64_t key) {
+    return shards[(key * 0x9e3779b97f4a7c15ULL) >> 60];
+  }
+
+  size_t capacity;
+  atomic<size_t> pinned;
+  atomic<size_t> misses;
+  Shard shards[SHARDS];
+};
+
+// Entries of a data block, each a varint row key length plus one (0 when
+// the row is the same as the previous entry's) and the key, the column as
+// 4 bytes, a varint expiry time (0 for none), then a varint value length
+// and the value
+class BlockCursor {
+public:
+  BlockCursor(string_view block) : column(0), expiresAt(0), p(block.data()), end(block.data() + block.size()) { }
+
+  // Step to the next entry, false at the end of the block or on corruption
+  bool next() {
+    uint64_t rowLength, expiry, valueLength;
+
+    if (p >= end || !readVarint(p, end, rowLength) || rowLength > (uint64_t) (end - p) + 1) {
+      return false;
+    }
+
+    if (rowLength > 0) {
+      row = string_view(p, rowLength - 1);
+      p += rowLength - 1;
+    }
+
+    if (end - p < 4) {
+      return false;
+    }
+
+    column = (int) readFixed32(p);
+    p += 4;
+
+    if (!readVarint(p, end, expiry) || !readVarint(p, end, valueLength) || valueLength > (uint64_t) (end - p)) {
+      return false;
+    }
+
+    expiresAt = expiry;
+    value = string_view(p, valueLength);
+    p += valueLength;
+
+    return true;
   }
+
+  string_view row;
+  int column;
+  uint32_t expiresAt;
+  string_view value;
+
+private:
+  const char* p;
+  const char* end;
+};
+
+// Columns of one row within a range, in column order or reversed, read
+// from a single memtable or table. value stays valid until the next call
+// to next().
+class ColumnSource {
+public:
+  virtual ~ColumnSource() { }
+
+  virtual bool next() = 0;
+
+  int column = 0;
+  uint32_t expiresAt = 0;
+  string_view value;
+};
+
+struct ColumnEntry {
+  int column;
+  uint32_t expiresAt;
+  string_view value;
+};
+
+// A value with an expiry time is gone from that second on
+inline bool expired(uint32_t expiresAt, uint32_t now) {
+  return expiresAt != 0 && expiresAt <= now;
+}
+
+// Expiry time for a TTL given at now, 0 for none; saturates rather than
+// wrapping, so a huge TTL means the last representable second
+inline uint32_t expiryTime(uint32_t now, uint32_t ttlSeconds) {
+  return ttlSeconds == 0 ? 0 : (uint32_t) min<uint64_t>((uint64_t) now + ttlSeconds, UINT32_MAX);
 }
 
+const uint64_t SSTABLE_MAGIC = 0x33454c4241545353ULL;  // "SSTABLE3"
+const size_t SSTABLE_FOOTER = 40;
+
+const char BLOCK_RAW = 0;
+const char BLOCK_LZ = 1;
+
+// Writes entries, added in key order, as an SSTable: data blocks of about
+// blockSize bytes, a Bloom filter of the row keys, a sparse index with the
+// first key, offset and size of every block, and a footer with the offsets
+// and sizes of filter and index and a magic number. A stored data block is
+// a type byte followed by the block, or with compression by its size as a
+// varint and the lzCompress output.
+class SSTableWriter {
+public:
+  SSTableWriter(const string& path, size_t blockSize, int bloomBitsPerKey, bool compression)
+    : path(path), out(path, ios::binary | ios::trunc), blockSize(blockSize), bloomBitsPerKey(bloomBitsPerKey),
+      compression(compression), offset(0), firstColumn(0) { }
+
+  void add(string_view row, int column, string_view value, uint32_t expiresAt) {
+    bool newRow = rowHashes.empty() || row != lastRow;
+    bool sameRow = !block.empty() && !newRow;
+
+    if (block.empty()) {
+      firstRow.assign(row);
+      firstColumn = column;
+    }
+
+    if (newRow) {
+      lastRow.assign(row);
+      rowHashes.push_back(hashKey(row));
+    }
+
+    appendVarint(block, sameRow ? 0 : row.size() + 1);
+
+    if (!sameRow) {
+      block.append(row);
+    }
+
+    appendFixed32(block, column);
+    appendVarint(block, expiresAt);
+    appendVarint(block, value.size());
+    block.append(value);
+
+    if (block.size() >= blockSize) {
+      flushBlock();
+    }
+  }
+
+  // Write the index and footer and fsync the file, false on I/O error
+  bool finish() {
+    flushBlock();
+
+    string filter = BloomFilter::build(rowHashes, bloomBitsPerKey);
+    string footer;
+
+    appendFixed64(footer, offset);
+    appendFixed64(footer, filter.size());
+    appendFixed64(footer, offset + filter.size());
+    appendFixed64(footer, index.size());
+    appendFixed64(footer, SSTABLE_MAGIC);
+    out.write(filter.data(), filter.size());
+    out.write(index.data(), index.size());
+    out.write(footer.data(), footer.size());
+    offset += filter.size() + index.size() + footer.size();
+    out.close();
+
+    return !out.fail() && syncPath(path);
+  }
+
+  uint64_t size() const {
+    return offset;
+  }
+
+private:
+  void flushBlock() {
+    if (block.empty()) {
+      return;
+    }
+
+    string stored(1, BLOCK_RAW);
+
+    if (compression) {
+      string compressed = lzCompress(block);
+
+      if (compressed.size() <= block.size() - block.size() / 8) {
+        stored[0] = BLOCK_LZ;
+        appendVarint(stored, block.size());
+        stored += compressed;
+      }
+    }
+
+    if (stored[0] == BLOCK_RAW) {
+      stored += block;
+    }
+
+    appendVarint(index, firstRow.size());
+    index += firstRow;
+    appendFixed32(index, firstColumn);
+    appendVarint(index, offset);
+    appendVarint(index, stored.size());
+
+    out.write(stored.data(), stored.size());
+    offset += stored.size();
+    block.clear();
+  }
+
+  string path;
+  ofstream out;
+  size_t blockSize;
+  int bloomBitsPerKey;
+  bool compression;
+  uint64_t offset;
+  string block;
+  string index;
+  string firstRow;
+  int firstColumn;
+  string lastRow;
+  vector<uint64_t> rowHashes;
+};
+
+// Immutable sorted file written by SSTableWriter. The filter and block
+// index are loaded at open and pinned in the block cache; a query skips
+// the table when the filter rules out its row and otherwise reads, through
+// the cache, only the blocks the index says can hold its column range.
+// Once compaction replaces a table it is marked obsolete, and the file is
+// deleted when the last query or scan holding the table lets go of it.
+class SSTable {
+public:
+  // Open a table file, nullptr if it is missing or malformed
+  static shared_ptr<SSTable> open(const string& path, uint64_t number, shared_ptr<BlockCache> cache) {
+    int fd = ::open(path.c_str(), O_RDONLY);
+
+    if (fd < 0) {
+      return nullptr;
+    }
+
+    shared_ptr<SSTable> table(new SSTable(path, number, fd, cache));
+    struct stat st;
+    char footer[SSTABLE_FOOTER];
+
+    if (fstat(fd, &st) != 0 || (size_t) st.st_size < SSTABLE_FOOTER ||
+        pread(fd, footer, SSTABLE_FOOTER, st.st_size - SSTABLE_FOOTER) != (ssize_t) SSTABLE_FOOTER ||
+        readFixed64(footer + 32) != SSTABLE_MAGIC) {
+      return nullptr;
+    }
+
+    uint64_t filterOffset = readFixed64(footer), filterSize = readFixed64(footer + 8);
+    uint64_t indexOffset = readFixed64(footer + 16), indexSize = readFixed64(footer + 24);
+    uint64_t dataEnd = st.st_size - SSTABLE_FOOTER;
+
+    if (filterOffset > dataEnd || filterSize > dataEnd - filterOffset ||
+        indexOffset > dataEnd || indexSize > dataEnd - indexOffset) {
+      return nullptr;
+    }
+
+    string index(indexSize, 0);
+
+    table->filter.resize(filterSize);
+
+    if (pread(fd, &index[0], indexSize, indexOffset) != (ssize_t) indexSize ||
+        pread(fd, &table->filter[0], filterSize, filterOffset) != (ssize_t) filterSize) {
+      return nullptr;
+    }
+
+    const char* p = index.data();
+    const char* end = p + index.size();
+
+    while (p < end) {
+      BlockHandle handle;
+      uint64_t rowLength, offset, size;
+
+      if (!readVarint(p, end, rowLength) || rowLength + 4 > (uint64_t) (end - p)) {
+        return nullptr;
+      }
+
+      handle.firstRow.assign(p, rowLength);
+      handle.firstColumn = (int) readFixed32(p + rowLength);
+      p += rowLength + 4;
+
+      if (!readVarint(p, end, offset) || !readVarint(p, end, size) || offset + size > filterOffset) {
+        return nullptr;
+      }
+
+      handle.offset = offset;
+      handle.size = size;
+      table->blocks.push_back(move(handle));
+    }
+
+    table->bytes = st.st_size;
+    table->pinnedBytes = index.size() + table->filter.size();
+    cache->pin(table->pinnedBytes);
+
+    return table;
+  }
+
+  ~SSTable() {
+    close(fd);
+    cache->unpin(pinnedBytes);
+
+    if (obsolete) {
+      unlink(path.c_str());
+    }
+  }
+
+  uint64_t number() const {
+    return fileNumber;
+  }
+
+  uint64_t fileSize() const {
+    return bytes;
+  }
+
+  void markObsolete() {
+    obsolete = true;
+  }
+
+  bool mayContain(uint64_t rowHash) const {
+    return BloomFilter::mayContain(filter, rowHash);
+  }
+
+  // Columns of row in [start, end] from the table, skipping it when the
+  // filter rules the row out. Blocks are read through the cache one at a
+  // time and values point into the current block.
+  class RowCursor : public ColumnSource {
+  public:
+    RowCursor(shared_ptr<SSTable> table, const string& row, uint64_t rowHash, int start, int end, bool reverse)
+      : table(table), row(row), start(start), end(end), reverse(reverse), low(0), high(0), remaining(0), entry(0) {
+      const vector<BlockHandle>& blocks = table->blocks;
+
+      if (blocks.empty() || !BloomFilter::mayContain(table->filter, rowHash)) {
+        return;
+      }
+
+      size_t last = table->findBlock(row, end);
+
+      if (compareKeys(blocks[last].firstRow, blocks[last].firstColumn, row, end) > 0) {
+        return;
+      }
+
+      low = table->findBlock(row, start);
+      high = last;
+      remaining = high - low + 1;
+    }
+
+    bool next() override {
+      while (entry == entries.size()) {
+        if (!loadBlock()) {
+          return false;
+        }
+      }
+
+      column = entries[entry].column;
+      expiresAt = entries[entry].expiresAt;
+      value = entries[entry].value;
+      entry++;
+
+      return true;
+    }
+
+  private:
+    // Decode the next block in scan order, keeping the entries in range
+    bool loadBlock() {
+      if (remaining == 0) {
+        return false;
+      }
+
+      size_t b = reverse ? high-- : low++;
+
+      remaining--;
+      block = table->cachedBlock(b);
+      entries.clear();
+      entry = 0;
+
+      if (!block) {
+        remaining = 0;
+        return false;
+      }
+
+      BlockCursor cursor(*block);
+
+      while (cursor.next()) {
+        if (cursor.row == row && cursor.column >= start && cursor.column <= end) {
+          entries.push_back({cursor.column, cursor.expiresAt, cursor.value});
+        }
+      }
+
+      if (reverse) {
+        std::reverse(entries.begin(), entries.end());
+      }
+
+      return true;
+    }
+
+    shared_ptr<SSTable> table;
+    string row;
+    int start;
+    int end;
+    bool reverse;
+    size_t low;
+    size_t high;
+    size_t remaining;
+    shared_ptr<const string> block;
+    vector<ColumnEntry> entries;
+    size_t entry;
+  };
+
+  // Every entry in key order, one block in memory at a time
+  class Scanner {
+  public:
+    Scanner(const SSTable& table) : table(table), block(0), cursor(string_view()) { }
+
+    bool next() {
+      while (!cursor.next()) {
+        if (block == table.blocks.size() || !table.readBlock(block++, buffer)) {
+          return false;
+        }
+
+        cursor = BlockCursor(buffer);
+      }
+
+      return true;
+    }
+
+    string_view row() const {
+      return cursor.row;
+    }
+
+    int column() const {
+      return cursor.column;
+    }
+
+    uint32_t expiresAt() const {
+      return cursor.expiresAt;
+    }
+
+    string_view value() const {
+      return cursor.value;
+    }
+
+  private:
+    const SSTable& table;
+    size_t block;
+    string buffer;
+    BlockCursor cursor;
+  };
+
+private:
+  struct BlockHandle {
+    string firstRow;
+    int firstColumn;
+    uint64_t offset;
+    uint64_t size;
+  };
+
+  SSTable(const string& path, uint64_t number, int fd, shared_ptr<BlockCache> cache)
+    : path(path), fileNumber(number), fd(fd), cache(cache), bytes(0), pinnedBytes(0), obsolete(false) { }
+
+  // Last block whose first key is at or before (row, column), or 0
+  size_t findBlock(const string& row, int column) const {
+    size_t lo = 0, hi = blocks.size();
+
+    while (lo < hi) {
+      size_t mid = (lo + hi) / 2;
+
+      if (compareKeys(blocks[mid].firstRow, blocks[mid].firstColumn, row, column) <= 0) {
+        lo = mid + 1;
+      } else {
+        hi = mid;
+      }
+    }
+
+    return lo == 0 ? 0 : lo - 1;
+  }
+
+  // Read and decode block b, false on I/O error or corruption
+  bool readBlock(size_t b, string& buffer) const {
+    string stored(blocks[b].size, 0);
+
+    if (stored.empty() || pread(fd, &stored[0], stored.size(), blocks[b].offset) != (ssize_t) stored.size()) {
+      return false;
+    }
+
+    if (stored[0] == BLOCK_RAW) {
+      buffer.assign(stored, 1, string::npos);
+      return true;
+    }
+
+    const char* p = stored.data() + 1;
+    const char* end = stored.data() + stored.size();
+    uint64_t size;
+
+    return stored[0] == BLOCK_LZ && readVarint(p, end, size) && size <= 256 * blocks[b].size &&
+           lzDecompress(string_view(p, end - p), size, buffer);
+  }
+
+  // Block b from the cache, read and cached on a miss; nullptr on I/O error
+  shared_ptr<const string> cachedBlock(size_t b) const {
+    shared_ptr<const string> block = cache->lookup(fileNumber, blocks[b].offset);
+
+    if (block) {
+      return block;
+    }
+
+    shared_ptr<string> buffer = make_shared<string>();
+
+    cache->countMiss();
+
+    if (!readBlock(b, *buffer)) {
+      return nullptr;
+    }
+
+    cache->insert(fileNumber, blocks[b].offset, buffer);
+
+    return buffer;
+  }
+
+  string path;
+  uint64_t fileNumber;
+  int fd;
+  shared_ptr<BlockCache> cache;
+  uint64_t bytes;
+  size_t pinnedBytes;
+  atomic<bool> obsolete;
+  vector<BlockHandle> blocks;
+  string filter;
+};
+
+// First index of keys[0, n) not less than key: branchless binary search
+// down to a window of 16 keys, which is then counted with SIMD compares
+size_t lowerBound(const int* keys, size_t n, int key) {
+  const int* base = keys;
+
+  while (n > 16) {
+    size_t half = n / 2;
+
+    base = base[half] < key ? base + half : base;
+    n -= half;
+  }
+
+  size_t below = 0, i = 0;
+
+#ifdef __SSE2__
+  __m128i target = _mm_set1_epi32(key);
+  __m128i count = _mm_setzero_si128();
+
+  for (; i + 4 <= n; i += 4) {
+    count = _mm_sub_epi32(count, _mm_cmplt_epi32(_mm_loadu_si128((const __m128i*) (base + i)), target));
+  }
+
+  count = _mm_add_epi32(count, _mm_shuffle_epi32(count, _MM_SHUFFLE(1, 0, 3, 2)));
+  count = _mm_add_epi32(count, _mm_shuffle_epi32(count, _MM_SHUFFLE(2, 3, 0, 1)));
+  below = _mm_cvtsi128_si32(count);
+#endif
+
+  for (; i < n; i++) {
+    below += base[i] < key;
+  }
+
+  return base - keys + below;
+}
+
+// First index of keys[0, n) greater than key
+size_t upperBound(const int* keys, size_t n, int key) {
+  return key == INT_MAX ? n : lowerBound(keys, n, key + 1);
+}
+
+// Append-only storage for memtable values; a value never moves once copied
+// in, so cursors can point at it while inserts continue
+class Arena {
+public:
+  Arena() : current(nullptr), left(0), allocated(0) { }
+
+  string_view copy(string_view value) {
+    if (value.empty()) {
+      return string_view();
+    }
+
+    char* p;
+
+    if (value.size() > CHUNK / 4) {
+      chunks.emplace_back(new char[value.size()]);
+      p = chunks.back().get();
+      allocated += value.size();
+    } else {
+      if (value.size() > left) {
+        chunks.emplace_back(new char[CHUNK]);
+        current = chunks.back().get();
+        left = CHUNK;
+        allocated += CHUNK;
+      }
+
+      p = current;
+      current += value.size();
+      left -= value.size();
+    }
+
+    memcpy(p, value.data(), value.size());
+
+    return string_view(p, value.size());
+  }
+
+  size_t bytes() const {
+    return allocated;
+  }
+
+private:
+  static const size_t CHUNK = 64 << 10;
+
+  vector<unique_ptr<char[]>> chunks;
+  char* current;
+  size_t left;
+  size_t allocated;
+};
+
+const uint32_t NO_VERSION = UINT32_MAX;
+
+// A value written to a memtable. An overwrite adds a newer version that
+// links to this one, so older snapshots still find it.
+struct CellVersion {
+  const char* data;  // in the memtable's arena
+  uint32_t size;
+  uint32_t older;
+  uint64_t sequence;
+  uint32_t expiresAt;
+
+  string_view value() const {
+    return string_view(data, size);
+  }
+};
+
+// Columns of one memtable row: a sorted run of keys in one array and a
+// small sorted insert buffer, with the newest version of every key in
+// parallel arrays. Appends past the last key go straight to the run; other
+// new keys go to the buffer, which is merged into the run once it holds
+// more than four times the square root of the run's size, trading short
+// moves within the buffer for fewer merges. generation changes whenever
+// keys move, telling cursors to find their place again.
+struct RowColumns {
+  vector<int> keys;
+  vector<uint32_t> heads;
+  vector<int> bufferKeys;
+  vector<uint32_t> bufferHeads;
+  uint64_t generation = 0;
+
+  // Newest version of column, nullptr if the row lacks it
+  uint32_t* find(int column) {
+    size_t i = lowerBound(keys.data(), keys.size(), column);
+
+    if (i < keys.size() && keys[i] == column) {
+      return &heads[i];
+    }
+
+    i = lowerBound(bufferKeys.data(), bufferKeys.size(), column);
+
+    return i < bufferKeys.size() && bufferKeys[i] == column ? &bufferHeads[i] : nullptr;
+  }
+
+  // Add a column the row lacks
+  void insert(int column, uint32_t head) {
+    if (keys.empty() || column > keys.back()) {
+      keys.push_back(column);
+      heads.push_back(head);
+      return;
+    }
+
+    size_t i = lowerBound(bufferKeys.data(), bufferKeys.size(), column);
+
+    bufferKeys.insert(bufferKeys.begin() + i, column);
+    bufferHeads.insert(bufferHeads.begin() + i, head);
+    generation++;
+
+    if (bufferKeys.size() > 32 && bufferKeys.size() * bufferKeys.size() > 16 * keys.size()) {
+      merge();
+    }
+  }
+
+  // Visit (column, newest version) in column order
+  template <class Visit>
+  void forEach(Visit visit) const {
+    size_t i = 0, j = 0;
+
+    while (i < keys.size() || j < bufferKeys.size()) {
+      if (j == bufferKeys.size() || (i < keys.size() && keys[i] < bufferKeys[j])) {
+        visit(keys[i], heads[i]);
+        i++;
+      } else {
+        visit(bufferKeys[j], bufferHeads[j]);
+        j++;
+      }
+    }
+  }
+
+  size_t bytes() const {
+    return (keys.capacity() + bufferKeys.capacity()) * sizeof(int) +
+           (heads.capacity() + bufferHeads.capacity()) * sizeof(uint32_t);
+  }
+
+private:
+  void merge() {
+    vector<int> mergedKeys;
+    vector<uint32_t> mergedHeads;
+
+    mergedKeys.reserve(keys.size() + bufferKeys.size());
+    mergedHeads.reserve(keys.size() + bufferKeys.size());
+    forEach([&](int column, uint32_t head) {
+      mergedKeys.push_back(column);
+      mergedHeads.push_back(head);
+    });
+    keys.swap(mergedKeys);
+    heads.swap(mergedHeads);
+    bufferKeys.clear();
+    bufferHeads.clear();
+    generation++;
+  }
+};
+
+// Rows of unflushed inserts and the logs that hold them, split by row key
+// hash into shards with their own lock, rows, versions and arena, so
+// cursors and inserts on rows of different shards never wait for each
+// other. Every version is tagged with the sequence number of its insert,
+// so a cursor reads the memtable as it was when the cursor was opened.
+// Inserts come from one writer at a time.
+struct Memtable {
+  static const size_t SHARDS = 16;
+
+  struct Shard {
+    mutex mtx;  // guards rows and versions against cursors reading them
+    map<string, RowColumns> rows;
+    vector<CellVersion> versions;
+    Arena arena;
+
+    // Newest version from head on written at or before sequence, or nullptr
+    const CellVersion* visible(uint32_t head, uint64_t sequence) const {
+      while (head != NO_VERSION && versions[head].sequence > sequence) {
+        head = versions[head].older;
+      }
+
+      return head == NO_VERSION ? nullptr : &versions[head];
+    }
+  };
+
+  Shard shards[SHARDS];
+  atomic<size_t> bytes{0};
+  vector<uint64_t> logs;
+
+  Shard& shardOf(const string& rowKey) {
+    return shards[hashKey(rowKey) % SHARDS];
+  }
+
+  void insert(const string& rowKey, int columnKey, string_view value, uint64_t sequence, uint32_t expiresAt = 0) {
+    Shard& shard = shardOf(rowKey);
+    lock_guard<mutex> lock(shard.mtx);
+
+    insertColumn(shard, rowOf(shard, rowKey), columnKey, value, sequence, expiresAt);
+  }
+
+  // Insert mutations[i] for every i in [first, last), all of one row, with
+  // sequence number firstSequence + i, looking the row up once. TTLs count
+  // from now.
+  void insertRow(const vector<Mutation>& mutations, const size_t* first, const size_t* last, uint64_t firstSequence,
+                 uint32_t now) {
+    const string& rowKey = mutations[*first].rowKey;
+    Shard& shard = shardOf(rowKey);
+    lock_guard<mutex> lock(shard.mtx);
+    RowColumns& row = rowOf(shard, rowKey);
+
+    for (const size_t* i = first; i != last; i++) {
+      const Mutation& m = mutations[*i];
+
+      insertColumn(shard, row, m.columnKey, m.value, firstSequence + *i, expiryTime(now, m.ttlSeconds));
+    }
+  }
+
+  bool empty() {
+    for (Shard& shard: shards) {
+      if (!shard.rows.empty()) {
+        return false;
+      }
+    }
+
+    return true;
+  }
+
+  // Visit (rowKey, columns, shard) in row key order; the memtable must no
+  // longer take inserts
+  template <class Visit>
+  void forEachRow(Visit visit) {
+    vector<tuple<const string*, RowColumns*, Shard*>> rows;
+
+    for (Shard& shard: shards) {
+      for (auto& row: shard.rows) {
+        rows.emplace_back(&row.first, &row.second, &shard);
+      }
+    }
+
+    sort(rows.begin(), rows.end(), [](auto& a, auto& b) { return *get<0>(a) < *get<0>(b); });
+
+    for (auto& row: rows) {
+      visit(*get<0>(row), *get<1>(row), *get<2>(row));
+    }
+  }
+
+private:
+  RowColumns& rowOf(Shard& shard, const string& rowKey) {
+    auto row = shard.rows.find(rowKey);
+
+    if (row == shard.rows.end()) {
+      row = shard.rows.emplace(rowKey, RowColumns()).first;
+      bytes += rowKey.size() + 128;
+    }
+
+    return row->second;
+  }
+
+  void insertColumn(Shard& shard, RowColumns& row, int columnKey, string_view value, uint64_t sequence,
+                    uint32_t expiresAt) {
+    uint32_t version = shard.versions.size();
+    uint32_t* head = row.find(columnKey);
+    string_view copy = shard.arena.copy(value);
+
+    shard.versions.push_back({copy.data(), (uint32_t) copy.size(), NO_VERSION, sequence, expiresAt});
+    bytes += value.size() + sizeof(CellVersion);
+
+    if (head) {
+      shard.versions.back().older = *head;
+      *head = version;
+    } else {
+      row.insert(columnKey, version);
+      bytes += sizeof(int) + sizeof(uint32_t);
+    }
+  }
+};
+
+// Columns of one row of a memtable in [start, end] as of a sequence
+// number. Columns are collected in batches under the shard lock; their
+// values live in the arena, so they stay valid after the lock is dropped.
+class MemtableCursor : public ColumnSource {
+public:
+  MemtableCursor(shared_ptr<Memtable> memtable, const string& rowKey, int start, int end, bool reverse,
+                 uint64_t sequence)
+    : memtable(memtable), shard(memtable->shardOf(rowKey)), row(nullptr), start(start), end(end),
+      reverse(reverse), sequence(sequence), generation(0), runPos(0), bufferPos(0), lastColumn(0),
+      started(false), positioned(false), batchPos(0) {
+    lock_guard<mutex> lock(shard.mtx);
+    auto found = shard.rows.find(rowKey);
+
+    if (found != shard.rows.end()) {
+      row = &found->second;
+    }
+  }
+
+  bool next() override {
+    if (batchPos == batch.size() && !fill()) {
+      return false;
+    }
+
+    column = batch[batchPos].column;
+    expiresAt = batch[batchPos].expiresAt;
+    value = batch[batchPos].value;
+    batchPos++;
+
+    return true;
+  }
+
+private:
+  static const size_t BATCH = 64;
+
+  // Collect the next visible columns, false when there are none
+  bool fill() {
+    lock_guard<mutex> lock(shard.mtx);
+
+    batch.clear();
+    batchPos = 0;
+
+    if (!row) {
+      return false;
+    }
+
+    if (!positioned || generation != row->generation) {
+      seek();
+    }
+
+    while (batch.size() < BATCH) {
+      bool fromRun;
+      int key;
+      uint32_t head;
+
+      if (!reverse) {
+        bool haveRun = runPos < row->keys.size(), haveBuffer = bufferPos < row->bufferKeys.size();
+
+        if (!haveRun && !haveBuffer) {
+          row = nullptr;
+          break;
+        }
+
+        fromRun = haveRun && (!haveBuffer || row->keys[runPos] < row->bufferKeys[bufferPos]);
+        key = fromRun ? row->keys[runPos] : row->bufferKeys[bufferPos];
+
+        if (key > end) {
+          row = nullptr;
+          break;
+        }
+
+        head = fromRun ? row->heads[runPos++] : row->bufferHeads[bufferPos++];
+      } else {
+        bool haveRun = runPos > 0, haveBuffer = bufferPos > 0;
+
+        if (!haveRun && !haveBuffer) {
+          row = nullptr;
+          break;
+        }
+
+        fromRun = haveRun && (!haveBuffer || row->keys[runPos - 1] > row->bufferKeys[bufferPos - 1]);
+        key = fromRun ? row->keys[runPos - 1] : row->bufferKeys[bufferPos - 1];
+
+        if (key < start) {
+          row = nullptr;
+          break;
+        }
+
+        head = fromRun ? row->heads[--runPos] : row->bufferHeads[--bufferPos];
+      }
+
+      lastColumn = key;
+      started = true;
+
+      if (const CellVersion* version = shard.visible(head, sequence)) {
+        batch.push_back({key, version->expiresAt, version->value()});
+      }
+    }
+
+    return !batch.empty();
+  }
+
+  // Place runPos and bufferPos after lastColumn, or at the range bound
+  // before the first column. In reverse they count the keys still ahead.
+  void seek() {
+    const RowColumns& r = *row;
+
+    if (!reverse) {
+      runPos = started ? upperBound(r.keys.data(), r.keys.size(), lastColumn)
+                       : lowerBound(r.keys.data(), r.keys.size(), start);
+      bufferPos = started ? upperBound(r.bufferKeys.data(), r.bufferKeys.size(), lastColumn)
+                          : lowerBound(r.bufferKeys.data(), r.bufferKeys.size(), start);
+    } else {
+      runPos = started ? lowerBound(r.keys.data(), r.keys.size(), lastColumn)
+                       : upperBound(r.keys.data(), r.keys.size(), end);
+      bufferPos = started ? lowerBound(r.bufferKeys.data(), r.bufferKeys.size(), lastColumn)
+                          : upperBound(r.bufferKeys.data(), r.bufferKeys.size(), end);
+    }
+
+    generation = r.generation;
+    positioned = true;
+  }
+
+  shared_ptr<Memtable> memtable;
+  Memtable::Shard& shard;
+  RowColumns* row;
+  int start;
+  int end;
+  bool reverse;
+  uint64_t sequence;
+  uint64_t generation;
+  size_t runPos;
+  size_t bufferPos;
+  int lastColumn;
+  bool started;
+  bool positioned;
+  vector<ColumnEntry> batch;
+  size_t batchPos;
+};
+
+struct ScanOptions {
+  size_t limit = SIZE_MAX;  // most columns to return
+  bool reverse = false;     // descending column order
+  string pageToken;         // resume after the page that returned this token
+};
+
+// Log-structured storage engine. An insert goes to the memtable and to the
+// write-ahead log; concurrent inserts are group committed, one of them
+// writing (and with syncWrites syncing) the log for all that queued behind
+// it. A full memtable becomes immutable and a background thread writes it
+// out as an SSTable, after which its log is deleted; inserts only wait if
+// the previous memtable is still being flushed.
+//
+// The same thread compacts with a size-tiered policy: a table's tier is the
+// power of mergeFactor its size falls in, measured in memtables, and when
+// mergeFactor tables adjacent in age share a tier they are merged into one,
+// keeping only the newest value of every cell. The list of live tables is
+// kept in a MANIFEST that is replaced atomically; on open the tables it
+// names are loaded, any other table files are deleted and leftover logs are
+// replayed. Tables, the MANIFEST and the directory are fsynced before the
+// logs or tables they replace are deleted, whatever syncWrites says.
+//
+// Unlike the old in-memory class, a default constructed Cassandra keeps its
+// data in ./cassandra-data and reopens whatever an earlier run left there.
+class Cassandra {
+public:
+  Cassandra(const string& directory = "cassandra-data", const CassandraOptions& options = CassandraOptions())
+    : directory(directory), options(options), cache(make_shared<BlockCache>(options.blockCacheBytes)),
+      memtable(make_shared<Memtable>()), nextFileNumber(1), sequence(0),
+      logFd(-1), logTicket(0), loggedTicket(0), logWriting(false), stopping(false), visibleSequence(0),
+      userBytes(0), diskBytes(0), syncs(0), flushes(0), compactions(0), expiredDropped(0) {
+    recover();
+    background = thread(&Cassandra::backgroundLoop, this);
+
+    if (options.queryThreads > 1) {
+      pool.reset(new ThreadPool(options.queryThreads - 1));
+    }
+  }
+
+  ~Cassandra() {
+    {
+      unique_lock<mutex> lock(mtx);
+
+      logCv.wait(lock, [this] { return !logWriting; });
+      writeLogLocked();
+      stopping = true;
+    }
+
+    workCv.notify_one();
+    roomCv.notify_all();
+    background.join();
+    close(logFd);
+  }
+
+  // Columns of a row, merged from the memtables and tables, newest value
+  // winning; a column whose newest value has expired is skipped. Everything
+  // is read as of when the cursor was opened, and the cursor keeps the
+  // memtables, tables and current blocks it reads alive, so it may outlive
+  // the Cassandra that opened it.
+  class Cursor {
+  public:
+    // Step to the next column, false once the range or limit is exhausted
+    bool next() {
+      if (remaining == 0) {
+        return false;
+      }
+
+      do {
+        for (size_t i = 0; i < sources.size(); i++) {
+          if (!started || (live[i] && sources[i]->column == lastColumn)) {
+            live[i] = sources[i]->next();
+          }
+        }
+
+        started = true;
+        current = sources.size();
+
+        // Sources are newest first, so on equal columns the first one wins
+        for (size_t i = 0; i < sources.size(); i++) {
+          if (live[i] && (current == sources.size() ||
+                          (reverse ? sources[i]->column > sources[current]->column
+                                   : sources[i]->column < sources[current]->column))) {
+            current = i;
+          }
+        }
+
+        if (current == sources.size()) {
+          remaining = 0;
+          exhausted = true;
+          return false;
+        }
+
+        lastColumn = sources[current]->column;
+      } while (expired(sources[current]->expiresAt, now));
+
+      remaining--;
+
+      return true;
+    }
+
+    int column() const {
+      return sources[current]->column;
+    }
+
+    // Valid until the next call to next()
+    string_view value() const {
+      return sources[current]->value;
+    }
+
+    // Token for ScanOptions::pageToken that continues after the last column
+    // returned, empty once the range is exhausted
+    string pageToken() const {
+      if (exhausted || !started) {
+        return "";
+      }
+
+      return (reverse ? "r" : "f") + to_string(lastColumn);
+    }
+
+  private:
+    friend class Cassandra;
+
+    Cursor(size_t limit, bool reverse, uint32_t now)
+      : current(0), lastColumn(0), remaining(limit), reverse(reverse), now(now), started(false), exhausted(false) { }
+
+    vector<unique_ptr<ColumnSource>> sources;
+    vector<bool> live;
+    size_t current;
+    int lastColumn;
+    size_t remaining;
+    bool reverse;
+    uint32_t now;
+    bool started;
+    bool exhausted;
+  };
+
+  // With a TTL the column expires ttlSeconds from now: reads skip it from
+  // then on and compaction drops it
+  void insert(string rowKey, int columnKey, string value, uint32_t ttlSeconds = 0) {
+    uint32_t expiresAt = expiryTime(options.clock(), ttlSeconds);
+    string record;
+
+    appendLogRecord(record, rowKey, columnKey, value, expiresAt);
+
+    unique_lock<mutex> lock(mtx);
+
+    if (memtable->bytes >= options.memtableBytes) {
+      rotateLocked(lock);
+    }
+
+    memtable->insert(rowKey, columnKey, value, ++sequence, expiresAt);
+    visibleSequence.store(sequence, memory_order_release);
+    logBuffer += record;
+    userBytes += rowKey.size() + value.size() + 4;
+    commitLocked(lock);
+  }
+
+  // Insert many columns at once: one log append and commit for the batch,
+  // and one row lookup per row key. Later mutations of a cell win.
+  void insertBatch(const vector<Mutation>& mutations) {
+    if (mutations.empty()) {
+      return;
+    }
+
+    string records;
+    vector<size_t> order(mutations.size());
+    size_t bytes = 0;
+    uint32_t now = options.clock();
+
+    for (auto& m: mutations) {
+      appendLogRecord(records, m.rowKey, m.columnKey, m.value, expiryTime(now, m.ttlSeconds));
+      bytes += m.rowKey.size() + m.value.size() + 4;
+    }
+
+    iota(order.begin(), order.end(), 0);
+    stable_sort(order.begin(), order.end(), [&mutations](size_t a, size_t b) {
+      return mutations[a].rowKey < mutations[b].rowKey;
+    });
+
+    unique_lock<mutex> lock(mtx);
+
+    if (memtable->bytes >= options.memtableBytes) {
+      rotateLocked(lock);
+    }
+
+    for (size_t i = 0, j; i < order.size(); i = j) {
+      for (j = i + 1; j < order.size() && mutations[order[j]].rowKey == mutations[order[i]].rowKey; j++) { }
+
+      memtable->insertRow(mutations, &order[i], &order[0] + j, sequence + 1, now);
+    }
+
+    sequence += mutations.size();
+    visibleSequence.store(sequence, memory_order_release);
+    logBuffer += records;
+    userBytes += bytes;
+    commitLocked(lock);
+  }
+
+  vector<pair<int, string>> query(string rowKey, int columnKey1, int columnKey2) {
+    assert(columnKey1 <= columnKey2);  
+
+    vector<pair<int, string>> result;
+
+    for (Cursor cursor = scan(rowKey, columnKey1, columnKey2); cursor.next(); ) {
+      result.emplace_back(cursor.column(), string(cursor.value()));
+    }
+
+    return result;
+  }
+
+  // Query the same columns of several rows at one snapshot, the rows
+  // spread over the query threads; results are in the order of rowKeys
+  vector<vector<pair<int, string>>> multiQuery(const vector<string>& rowKeys, int columnKey1, int columnKey2) {
+    assert(columnKey1 <= columnKey2);
+
+    vector<vector<pair<int, string>>> results(rowKeys.size());
+    shared_ptr<const ReadState> state = atomic_load(&readState);
+    uint64_t snapshot = visibleSequence.load(memory_order_acquire);
+    atomic<size_t> next(0);
+
+    auto work = [&] {
+      for (size_t i; (i = next++) < rowKeys.size(); ) {
+        for (Cursor cursor = scan(*state, snapshot, rowKeys[i], columnKey1, columnKey2, ScanOptions());
+             cursor.next(); ) {
+          results[i].emplace_back(cursor.column(), string(cursor.value()));
+        }
+      }
+    };
+
+    size_t helpers = pool && !rowKeys.empty() ? min(pool->size(), rowKeys.size() - 1) : 0;
+    mutex doneMtx;
+    condition_variable doneCv;
+    size_t pending = helpers;
+
+    for (size_t h = 0; h < helpers; h++) {
+      pool->submit([&] {
+        work();
+
+        lock_guard<mutex> lock(doneMtx);
+
+        if (--pending == 0) {
+          doneCv.notify_one();
+        }
+      });
+    }
+
+    work();
+
+    unique_lock<mutex> lock(doneMtx);
+
+    doneCv.wait(lock, [&] { return pending == 0; });
+
+    return results;
+  }
+
+  // Lazily read the columns of rowKey in [columnKey1, columnKey2]; an
+  // invalid page token gives an empty cursor
+  Cursor scan(const string& rowKey, int columnKey1, int columnKey2, const ScanOptions& scanOptions = ScanOptions()) {
+    // Loading the state first means every insert up to the snapshot is in
+    // it or in a newer memtable, so the cursor sees a prefix of the inserts
+    shared_ptr<const ReadState> state = atomic_load(&readState);
+
+    return scan(*state, visibleSequence.load(memory_order_acquire), rowKey, columnKey1, columnKey2, scanOptions);
+  }
+
+  // Write amplification: bytes written to logs and tables per byte inserted
+  double writeAmplification() const {
+    return userBytes ? (double) diskBytes / userBytes : 0;
+  }
+
+  // Data blocks queries had to read from disk
+  size_t diskReads() const {
+    return cache->missCount();
+  }
+
+  size_t syncCount() const {
+    return syncs.load();
+  }
+
+  size_t flushCount() const {
+    return flushes.load();
+  }
+
+  size_t compactionCount() const {
+    return compactions.load();
+  }
+
+  // Expired cells compaction has removed
+  size_t expiredCount() const {
+    return expiredDropped.load();
+  }
+
+  // Bytes in the live tables
+  uint64_t tableBytes() {
+    lock_guard<mutex> lock(mtx);
+    uint64_t total = 0;
+
+    for (auto& table: tables) {
+      total += table->fileSize();
+    }
+
+    return total;
+  }
+
+  size_t tableCount() {
+    lock_guard<mutex> lock(mtx);
+    return tables.size();
+  }
+
+  // Block until no flush is pending and no compaction is due
+  void waitForBackground() {
+    unique_lock<mutex> lock(mtx);
+
+    roomCv.wait(lock, [this] {
+      pair<size_t, size_t> run = pickCompactionLocked();
+      return stopping || (!immutable && run.first == run.second);
+    });
+  }
+
+private:
+  // What readers need, replaced as a whole whenever memtables or tables
+  // change so readers never take the writer lock
+  struct ReadState {
+    shared_ptr<Memtable> memtable;
+    shared_ptr<Memtable> immutable;
+    vector<shared_ptr<SSTable>> tables;
+  };
+
+  Cursor scan(const ReadState& state, uint64_t snapshot, const string& rowKey, int columnKey1, int columnKey2,
+              const ScanOptions& scanOptions) {
+    Cursor cursor(scanOptions.limit, scanOptions.reverse, options.clock());
+
+    if (!scanOptions.pageToken.empty()) {
+      char* tokenEnd;
+      long last = strtol(scanOptions.pageToken.c_str() + 1, &tokenEnd, 10);
+
+      // A page ending on the last key in its direction leaves nothing; the
+      // other extreme is an ordinary key to resume after
+      if (scanOptions.pageToken[0] != (scanOptions.reverse ? 'r' : 'f') || *tokenEnd != 0 ||
+          last < INT_MIN || last > INT_MAX || last == (scanOptions.reverse ? INT_MIN : INT_MAX)) {
+        return cursor;
+      }
+
+      if (scanOptions.reverse) {
+        columnKey2 = min<long>(columnKey2, last - 1);
+      } else {
+        columnKey1 = max<long>(columnKey1, last + 1);
+      }
+    }
+
+    if (columnKey1 > columnKey2) {
+      return cursor;
+    }
+
+    uint64_t rowHash = hashKey(rowKey);
+
+    for (auto& source: {state.memtable, state.immutable}) {
+      if (source) {
+        cursor.sources.emplace_back(
+            new MemtableCursor(source, rowKey, columnKey1, columnKey2, scanOptions.reverse, snapshot));
+      }
+    }
+
+    for (auto it = state.tables.rbegin(); it != state.tables.rend(); ++it) {
+      cursor.sources.emplace_back(
+          new SSTable::RowCursor(*it, rowKey, rowHash, columnKey1, columnKey2, scanOptions.reverse));
+    }
+
+    cursor.live.assign(cursor.sources.size(), false);
+
+    return cursor;
+  }
+
+  void publishLocked() {
+    atomic_store(&readState, shared_ptr<const ReadState>(new ReadState{memtable, immutable, tables}));
+  }
+
+  static void appendLogRecord(string& out, const string& rowKey, int columnKey, const string& value,
+                              uint32_t expiresAt) {
+    string record;
+
+    appendVarint(record, rowKey.size());
+    record += rowKey;
+    appendFixed32(record, columnKey);
+    appendVarint(record, expiresAt);
+    appendVarint(record, value.size());
+    record += value;
+    appendFixed32(out, record.size());
+    appendFixed32(out, crc32(record.data(), record.size()));
+    out += record;
+  }
+
+  // Group commit: wait until the log holds everything queued so far, the
+  // first waiter writing it for all of them
+  void commitLocked(unique_lock<mutex>& lock) {
+    uint64_t ticket = ++logTicket;
+
+    while (loggedTicket < ticket) {
+      if (logWriting) {
+        logCv.wait(lock);
+        continue;
+      }
+
+      string batch;
+      uint64_t upTo = logTicket;
+
+      batch.swap(logBuffer);
+      logWriting = true;
+      lock.unlock();
+
+      checkIo(writeAll(logFd, batch.data(), batch.size()), "log write");
+
+      if (options.syncWrites) {
+        checkIo(fdatasync(logFd) == 0, "log sync");
+        syncs++;
+      }
+
+      diskBytes += batch.size();
+      lock.lock();
+      logWriting = false;
+      loggedTicket = upTo;
+      logCv.notify_all();
+    }
+  }
+
+  string fileName(uint64_t number, const char* suffix) const {
+    return directory + "/" + to_string(number) + suffix;
+  }
+
+  void recover() {
+    mkdir(directory.c_str(), 0755);
+
+    ifstream manifest(directory + "/MANIFEST");
+    set<uint64_t> live;
+    string word;
+    uint64_t number;
+
+    while (manifest >> word >> number) {
+      if (word == "next") {
+        nextFileNumber = number;
+      } else if (word == "table") {
+        shared_ptr<SSTable> table = SSTable::open(fileName(number, ".sst"), number, cache);
+
+        checkIo(table != nullptr, "open table");
+        tables.push_back(table);
+        live.insert(number);
+      }
+    }
+
+    vector<uint64_t> logs;
+    DIR* dir = opendir(directory.c_str());
+
+    checkIo(dir != nullptr, "open directory");
+
+    while (dirent* entry = readdir(dir)) {
+      char* suffix;
+      uint64_t n = strtoull(entry->d_name, &suffix, 10);
+
+      if (suffix != entry->d_name && string(suffix) == ".log") {
+        logs.push_back(n);
+      } else if (suffix != entry->d_name && string(suffix) == ".sst" && !live.count(n)) {
+        unlink(fileName(n, ".sst").c_str());
+      }
+
+      nextFileNumber = max(nextFileNumber, n + 1);
+    }
+
+    closedir(dir);
+    sort(logs.begin(), logs.end());
+
+    for (uint64_t log: logs) {
+      replay(fileName(log, ".log"));
+      memtable->logs.push_back(log);
+    }
+
+    // Replayed data is flushed straight away, so the old logs can go
+    if (!memtable->empty()) {
+      immutable = memtable;
+      memtable = make_shared<Memtable>();
+    } else {
+      for (uint64_t log: logs) {
+        unlink(fileName(log, ".log").c_str());
+      }
+    }
+
+    openLogLocked();
+    visibleSequence = sequence;
+    publishLocked();
+  }
+
+  // Apply every intact record of a log; a torn record ends the log
+  void replay(const string& path) {
+    ifstream in(path, ios::binary);
+    string data((istreambuf_iterator<char>(in)), istreambuf_iterator<char>());
+    const char* p = data.data();
+    const char* end = p + data.size();
+
+    while (end - p >= 8) {
+      uint32_t length = readFixed32(p), crc = readFixed32(p + 4);
+
+      if (length > (size_t) (end - p - 8) || crc32(p + 8, length) != crc) {
+        break;
+      }
+
+      const char* q = p + 8;
+      const char* recordEnd = q + length;
+      uint64_t rowLength, expiresAt, valueLength;
+
+      if (!readVarint(q, recordEnd, rowLength) || rowLength + 4 > (uint64_t) (recordEnd - q)) {
+        break;
+      }
+
+      string rowKey(q, rowLength);
+      int columnKey = (int) readFixed32(q + rowLength);
+
+      q += rowLength + 4;
+
+      if (!readVarint(q, recordEnd, expiresAt) || !readVarint(q, recordEnd, valueLength) ||
+          valueLength != (uint64_t) (recordEnd - q)) {
+        break;
+      }
+
+      memtable->insert(rowKey, columnKey, string_view(q, valueLength), ++sequence, expiresAt);
+      p = recordEnd;
+    }
+  }
+
+  void openLogLocked() {
+    uint64_t number = nextFileNumber++;
+
+    logFd = ::open(fileName(number, ".log").c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0644);
+    checkIo(logFd >= 0, "open log");
+    checkIo(!options.syncWrites || syncPath(directory), "sync directory");
+    memtable->logs.push_back(number);
+  }
+
+  // Write out queued log records while holding the lock
+  void writeLogLocked() {
+    if (logBuffer.empty()) {
+      return;
+    }
+
+    checkIo(writeAll(logFd, logBuffer.data(), logBuffer.size()), "log write");
+
+    if (options.syncWrites) {
+      checkIo(fdatasync(logFd) == 0, "log sync");
+      syncs++;
+    }
+
+    diskBytes += logBuffer.size();
+    logBuffer.clear();
+    loggedTicket = logTicket;
+    logCv.notify_all();
+  }
+
+  // Hand the full memtable to the background thread and start a new one
+  // with its own log, first waiting for the previous one to be flushed
+  void rotateLocked(unique_lock<mutex>& lock) {
+    roomCv.wait(lock, [this] { return !immutable || stopping; });
+    logCv.wait(lock, [this] { return !logWriting; });
+
+    if (memtable->bytes < options.memtableBytes) {
+      return;
+    }
+
+    writeLogLocked();
+    close(logFd);
+    immutable = memtable;
+    memtable = make_shared<Memtable>();
+    openLogLocked();
+    publishLocked();
+    workCv.notify_one();
+  }
+
+  // Replace MANIFEST with the current table list
+  void writeManifestLocked() {
+    string path = directory + "/MANIFEST";
+    string tmp = path + ".tmp";
+
+    {
+      ofstream out(tmp, ios::trunc);
+
+      out << "next " << nextFileNumber << "\n";
+
+      for (auto& table: tables) {
+        out << "table " << table->number() << "\n";
+      }
+
+      checkIo(out.good(), "write manifest");
+    }
+
+    checkIo(syncPath(tmp), "sync manifest");
+    checkIo(rename(tmp.c_str(), path.c_str()) == 0, "rename manifest");
+    // Make the rename durable before callers unlink what it replaced
+    checkIo(syncPath(directory), "sync directory");
+  }
+
+  size_t tierOf(const SSTable& table) const {
+    size_t size = table.fileSize() / max<size_t>(1, options.memtableBytes);
+    size_t tier = 0;
+
+    while (size >= options.mergeFactor) {
+      size /= options.mergeFactor;
+      tier++;
+    }
+
+    return tier;
+  }
+
+  // First run of mergeFactor tables adjacent in age in the same tier, or empty
+  pair<size_t, size_t> pickCompactionLocked() const {
+    for (size_t start = 0; start + options.mergeFactor <= tables.size(); start++) {
+      size_t tier = tierOf(*tables[start]);
+      size_t end = start + 1;
+
+      while (end < tables.size() && end - start < options.mergeFactor && tierOf(*tables[end]) == tier) {
+        end++;
+      }
+
+      if (end - start == options.mergeFactor) {
+        return {start, end};
+      }
+    }
+
+    return {0, 0};
+  }
+
+  shared_ptr<SSTable> writeTable(Memtable& source, uint64_t number) {
+    string path = fileName(number, ".sst");
+    SSTableWriter writer(path, options.blockSize, options.bloomBitsPerKey, options.compression);
+
+    source.forEachRow([&](const string& rowKey, RowColumns& row, Memtable::Shard& shard) {
+      row.forEach([&](int column, uint32_t head) {
+        const CellVersion& version = shard.versions[head];
+
+        writer.add(rowKey, column, version.value(), version.expiresAt);
+      });
+    });
+
+    checkIo(writer.finish(), "write table");
+    checkIo(syncPath(directory), "sync directory");
+    diskBytes += writer.size();
+
+    return SSTable::open(path, number, cache);
+  }
+
+  // Merge tables given oldest first; on equal keys the newest value wins.
+  // An expired cell still hides the values below it, so it is only dropped
+  // when the filters of the older tables rule its row out.
+  shared_ptr<SSTable> mergeTables(const vector<shared_ptr<SSTable>>& inputs, const vector<shared_ptr<SSTable>>& older,
+                                  uint64_t number) {
+    string path = fileName(number, ".sst");
+    SSTableWriter writer(path, options.blockSize, options.bloomBitsPerKey, options.compression);
+    vector<unique_ptr<SSTable::Scanner>> scanners;
+
+    // Heap of scanners by key, newer table first on ties
+    auto later = [&scanners](size_t a, size_t b) {
+      int c = compareKeys(scanners[a]->row(), scanners[a]->column(), scanners[b]->row(), scanners[b]->column());
+      return c != 0 ? c > 0 : a < b;
+    };
+    priority_queue<size_t, vector<size_t>, decltype(later)> heap(later);
+
+    for (size_t i = 0; i < inputs.size(); i++) {
+      scanners.emplace_back(new SSTable::Scanner(*inputs[i]));
+
+      if (scanners[i]->next()) {
+        heap.push(i);
+      }
+    }
+
+    string lastRow;
+    int lastColumn = 0;
+    bool any = false, olderMayHaveRow = true;
+    uint32_t now = options.clock();
+
+    while (!heap.empty()) {
+      size_t i = heap.top();
+      SSTable::Scanner& scanner = *scanners[i];
+
+      heap.pop();
+
+      if (!any || compareKeys(scanner.row(), scanner.column(), lastRow, lastColumn) != 0) {
+        if (!any || scanner.row() != lastRow) {
+          uint64_t rowHash = hashKey(scanner.row());
+
+          olderMayHaveRow = any_of(older.begin(), older.end(), [rowHash](const shared_ptr<SSTable>& table) {
+            return table->mayContain(rowHash);
+          });
+        }
+
+        if (expired(scanner.expiresAt(), now) && !olderMayHaveRow) {
+          expiredDropped++;
+        } else {
+          writer.add(scanner.row(), scanner.column(), scanner.value(), scanner.expiresAt());
+        }
+
+        lastRow.assign(scanner.row());
+        lastColumn = scanner.column();
+        any = true;
+      }
+
+      if (scanner.next()) {
+        heap.push(i);
+      }
+    }
+
+    checkIo(writer.finish(), "write table");
+    checkIo(syncPath(directory), "sync directory");
+    diskBytes += writer.size();
+
+    return SSTable::open(path, number, cache);
+  }
+
+  void backgroundLoop() {
+    unique_lock<mutex> lock(mtx);
+
+    while (true) {
+      pair<size_t, size_t> run;
+
+      workCv.wait(lock, [&] {
+        run = pickCompactionLocked();
+        return stopping || immutable || run.first < run.second;
+      });
+
+      if (stopping) {
+        return;
+      }
+
+      if (immutable) {
+        shared_ptr<Memtable> source = immutable;
+        uint64_t number = nextFileNumber++;
+
+        lock.unlock();
+
+        shared_ptr<SSTable> table = writeTable(*source, number);
+
+        checkIo(table != nullptr, "reopen table");
+        lock.lock();
+        tables.push_back(table);
+        writeManifestLocked();
+
+        for (uint64_t log: source->logs) {
+          unlink(fileName(log, ".log").c_str());
+        }
+
+        immutable.reset();
+        publishLocked();
+        flushes++;
+        roomCv.notify_all();
+        continue;
+      }
+
+      vector<shared_ptr<SSTable>> inputs(tables.begin() + run.first, tables.begin() + run.second);
+      vector<shared_ptr<SSTable>> older(tables.begin(), tables.begin() + run.first);
+      uint64_t number = nextFileNumber++;
+
+      lock.unlock();
+
+      shared_ptr<SSTable> merged = mergeTables(inputs, older, number);
+
+      checkIo(merged != nullptr, "reopen table");
+      lock.lock();
+
+      // Only this thread removes tables and flushes only append, so the
+      // run is still at the same positions
+      tables.erase(tables.begin() + run.first, tables.begin() + run.second);
+      tables.insert(tables.begin() + run.first, merged);
+      writeManifestLocked();
+      publishLocked();
+
+      for (auto& input: inputs) {
+        input->markObsolete();
+      }
+
+      compactions++;
+      roomCv.notify_all();
+    }
+  }
+
+  string directory;
+  CassandraOptions options;
+  shared_ptr<BlockCache> cache;
+
+  // Guarded by mtx
+  mutex mtx;
+  condition_variable logCv;
+  condition_variable roomCv;
+  condition_variable workCv;
+  shared_ptr<Memtable> memtable;
+  shared_ptr<Memtable> immutable;
+  vector<shared_ptr<SSTable>> tables;
+  uint64_t nextFileNumber;
+  uint64_t sequence;
+  int logFd;
+  string logBuffer;
+  uint64_t logTicket;
+  uint64_t loggedTicket;
+  bool logWriting;
+  bool stopping;
+
+  // Replaced under mtx, read without it
+  shared_ptr<const ReadState> readState;
+  atomic<uint64_t> visibleSequence;
+
+  atomic<uint64_t> userBytes;
+  atomic<uint64_t> diskBytes;
+  atomic<size_t> syncs;
+  atomic<size_t> flushes;
+  atomic<size_t> compactions;
+  atomic<size_t> expiredDropped;
+  thread background;
+  unique_ptr<ThreadPool> pool;
+};
+
+// Delete a data directory and the files in it
+void removeDirectory(const string& directory) {
+  if (DIR* dir = opendir(directory.c_str())) {
+    while (dirent* entry = readdir(dir)) {
+      if (entry->d_name[0] != '.') {
+        unlink((directory + "/" + entry->d_name).c_str());
+      }
+    }
+
+    closedir(dir);
+  }
+
+  rmdir(directory.c_str());
+}
+
+// Sustained inserts of 100 byte values into 20K rows in random order with a
+// 4 MB memtable, so almost all of the data lives on disk, then the latency
+// of 20 column range queries on random rows
+void benchmarkStorage() {
+  const string directory = "cassandra-bench";
+  const int cells = 2000000, rows = 20000;
+  mt19937 rng(1);
+  string value(100, 'v');
+
+  removeDirectory(directory);
+
+  {
+    Cassandra cassandra(directory);
+    auto start = chrono::steady_clock::now();
+
+    for (int i = 0; i < cells; i++) {
+      value[i % 100] = 'a' + i % 26;
+      cassandra.insert("row" + to_string(rng() % rows), rng() % 1000, value);
+    }
+
+    double secs = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+    cout << "insert " << cells / secs << " cells/s, flushes " << cassandra.flushCount()
+         << ", compactions " << cassandra.compactionCount() << ", tables " << cassandra.tableCount()
+         << ", write amplification " << cassandra.writeAmplification() << endl;
+
+    vector<double> latencies;
+
+    cassandra.waitForBackground();
+
+    for (int q = 0; q < 2000; q++) {
+      int column = rng() % 980;
+      auto t0 = chrono::steady_clock::now();
+
+      cassandra.query("row" + to_string(rng() % rows), column, column + 19);
+      latencies.push_back(chrono::duration<double>(chrono::steady_clock::now() - t0).count());
+    }
+
+    sort(latencies.begin(), latencies.end());
+
+    cout << "range query p50 " << latencies[latencies.size() / 2] * 1e6 << " us"
+         << " p99 " << latencies[latencies.size() * 99 / 100] * 1e6 << " us" << endl;
+  }
+
+  removeDirectory(directory);
+
+  // Durable inserts: group commit shares one fdatasync among concurrent writers
+  for (int threads = 1; threads <= 8; threads *= 2) {
+    CassandraOptions options;
+
+    options.syncWrites = true;
+
+    Cassandra cassandra(directory, options);
+    vector<thread> writers;
+    const int perThread = 500;
+    auto start = chrono::steady_clock::now();
+
+    for (int t = 0; t < threads; t++) {
+      writers.emplace_back([&cassandra, t] {
+        for (int i = 0; i < perThread; i++) {
+          cassandra.insert("row" + to_string(t), i, "value");
+        }
+      });
+    }
+
+    for (thread& writer: writers) {
+      writer.join();
+    }
+
+    double secs = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+    cout << "synced writers=" << threads << " " << threads * perThread / secs << " inserts/s, "
+         << (double) threads * perThread / cassandra.syncCount() << " inserts per fsync" << endl;
+  }
+
+  removeDirectory(directory);
+}
+
+// Lookups of absent rows that sort between present ones, and 20 column
+// range queries on present rows, for tables without filters or cache
+// (every query reads the candidate block of every table), with filters,
+// and with filters and a block cache
+void benchmarkLookups() {
+  const string directory = "cassandra-bench";
+  const int cells = 1000000, rows = 20000;
+  const char* names[] = {"no filter, no cache", "bloom filter", "bloom filter + cache"};
+
+  for (int config = 0; config < 3; config++) {
+    CassandraOptions options;
+
+    options.bloomBitsPerKey = config == 0 ? 0 : 10;
+    options.blockCacheBytes = config == 2 ? 64 << 20 : 0;
+    removeDirectory(directory);
+
+    Cassandra cassandra(directory, options);
+    mt19937 rng(1);
+    string value(100, 'v');
+
+    for (int i = 0; i < cells; i++) {
+      cassandra.insert("row" + to_string(rng() % rows), rng() % 1000, value);
+    }
+
+    const int queries = 20000;
+
+    // Time the filter and cache, not a compaction running alongside
+    cassandra.waitForBackground();
+
+    size_t reads = cassandra.diskReads();
+    auto start = chrono::steady_clock::now();
+
+    for (int q = 0; q < queries; q++) {
+      cassandra.query("row" + to_string(q % rows) + "x", 0, 1000);
+    }
+
+    double negativeSecs = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    size_t negativeReads = cassandra.diskReads() - reads;
+
+    // Untimed pass so the cache, where there is one, is warm
+    for (int pass = 0; pass < 2; pass++) {
+      reads = cassandra.diskReads();
+      start = chrono::steady_clock::now();
+
+      for (int q = 0; q < queries; q++) {
+        int column = rng() % 980;
+
+        cassandra.query("row" + to_string(rng() % rows), column, column + 19);
+      }
+    }
+
+    double rangeSecs = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    size_t rangeReads = cassandra.diskReads() - reads;
+
+    cout << names[config] << " (" << cassandra.tableCount() << " tables): absent row "
+         << negativeSecs / queries * 1e6 << " us, " << (double) negativeReads / queries << " reads/query; range "
+         << rangeSecs / queries * 1e6 << " us, " << (double) rangeReads / queries << " reads/query" << endl;
+  }
+
+  removeDirectory(directory);
+}
+
+// Peak resident memory in KB
+long peakResidentKb() {
+  rusage usage;
+
+  getrusage(RUSAGE_SELF, &usage);
+
+  return usage.ru_maxrss;
+}
+
+// Scan of one row of 1M columns with 100 byte values: time to the first
+// column and to the end, and growth of peak memory, for the cursor, pages
+// of 1000 through page tokens, and query() which copies the whole row.
+// The cursor runs first since peak memory only grows.
+void benchmarkWideRow() {
+  const string directory = "cassandra-bench";
+  const int columns = 1000000;
+
+  removeDirectory(directory);
+
+  Cassandra cassandra(directory);
+  string value(100, 'v');
+
+  for (int i = 0; i < columns; i++) {
+    cassandra.insert("wide", i, value);
+  }
+
+  auto report = [](const char* name, size_t count, double first, double total, long peakBefore) {
+    cout << name << ": " << count << " columns, first after " << first * 1e6 << " us, all after "
+         << total * 1e3 << " ms, peak memory +" << (peakResidentKb() - peakBefore) / 1024 << " MB" << endl;
+  };
+
+  for (bool reverse: {false, true}) {
+    ScanOptions scanOptions;
+
+    scanOptions.reverse = reverse;
+
+    long peakBefore = peakResidentKb();
+    auto start = chrono::steady_clock::now();
+    Cassandra::Cursor cursor = cassandra.scan("wide", 0, INT_MAX, scanOptions);
+    size_t count = 0, bytes = 0;
+    double first = 0;
+
+    while (cursor.next()) {
+      if (count++ == 0) {
+        first = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+      }
+
+      bytes += cursor.value().size();
+    }
+
+    report(reverse ? "reverse cursor" : "cursor", count, first,
+           chrono::duration<double>(chrono::steady_clock::now() - start).count(), peakBefore);
+  }
+
+  long peakBefore = peakResidentKb();
+  auto start = chrono::steady_clock::now();
+  ScanOptions page;
+  size_t count = 0;
+  double first = 0;
+
+  page.limit = 1000;
+
+  do {
+    Cassandra::Cursor cursor = cassandra.scan("wide", 0, INT_MAX, page);
+
+    while (cursor.next()) {
+      if (count++ == 0) {
+        first = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+      }
+    }
+
+    page.pageToken = cursor.pageToken();
+  } while (!page.pageToken.empty());
+
+  report("pages of 1000", count, first, chrono::duration<double>(chrono::steady_clock::now() - start).count(),
+         peakBefore);
+
+  peakBefore = peakResidentKb();
+  start = chrono::steady_clock::now();
+
+  vector<pair<int, string>> result = cassandra.query("wide", 0, INT_MAX);
+  double total = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+  report("query()", result.size(), total, total, peakBefore);
+  removeDirectory(directory);
+}
+
+// Heap bytes in use, including blocks malloc maps separately
+size_t heapBytes() {
+  struct mallinfo2 info = mallinfo2();
+
+  return info.uordblks + info.hblkhd;
+}
+
+// One row of 200K columns with 20 byte values in the memtable layout and
+// in a std::map<int, string>: insert rate in column order and shuffled,
+// heap bytes per column, full scans and 100 column range scans
+void benchmarkColumnStorage() {
+  const int columns = 200000, scans = 20000;
+  vector<int> shuffled(columns);
+  string value(20, 'v');
+  mt19937 rng(1);
+
+  iota(shuffled.begin(), shuffled.end(), 0);
+  shuffle(shuffled.begin(), shuffled.end(), rng);
+
+  auto seconds = [](chrono::steady_clock::time_point start) {
+    return chrono::duration<double>(chrono::steady_clock::now() - start).count();
+  };
+
+  for (bool ordered: {true, false}) {
+    size_t heapBefore = heapBytes();
+    auto start = chrono::steady_clock::now();
+    map<int, string> row;
+
+    for (int i = 0; i < columns; i++) {
+      row[ordered ? i : shuffled[i]] = value;
+    }
+
+    double insertSecs = seconds(start);
+    size_t bytes = heapBytes() - heapBefore;
+    size_t sink = 0;
+
+    start = chrono::steady_clock::now();
+
+    for (auto& column: row) {
+      sink += column.second.size();
+    }
+
+    double scanSecs = seconds(start);
+
+    start = chrono::steady_clock::now();
+
+    for (int q = 0; q < scans; q++) {
+      auto it = row.lower_bound(shuffled[q] % (columns - 100));
+
+      for (int k = 0; k < 100; k++, ++it) {
+        sink += it->second.size();
+      }
+    }
+
+    double rangeSecs = seconds(start);
+
+    cout << "std::map " << (ordered ? "ordered" : "shuffled") << ": insert " << columns / insertSecs
+         << " columns/s, " << (double) bytes / columns << " bytes/column, scan " << columns / scanSecs
+         << " columns/s, 100 column ranges " << scans / rangeSecs << "/s" << (sink == 1 ? " " : "") << endl;
+  }
+
+  for (bool ordered: {true, false}) {
+    size_t heapBefore = heapBytes();
+    auto start = chrono::steady_clock::now();
+    shared_ptr<Memtable> memtable = make_shared<Memtable>();
+
+    for (int i = 0; i < columns; i++) {
+      memtable->insert("row", ordered ? i : shuffled[i], value, i + 1);
+    }
+
+    double insertSecs = seconds(start);
+    size_t bytes = heapBytes() - heapBefore;
+    size_t sink = 0;
+
+    start = chrono::steady_clock::now();
+
+    for (MemtableCursor cursor(memtable, "row", 0, INT_MAX, false, columns); cursor.next(); ) {
+      sink += cursor.value.size();
+    }
+
+    double scanSecs = seconds(start);
+
+    start = chrono::steady_clock::now();
+
+    for (int q = 0; q < scans; q++) {
+      int first = shuffled[q] % (columns - 100);
+
+      for (MemtableCursor cursor(memtable, "row", first, first + 99, false, columns); cursor.next(); ) {
+        sink += cursor.value.size();
+      }
+    }
+
+    double rangeSecs = seconds(start);
+
+    cout << "memtable row " << (ordered ? "ordered" : "shuffled") << ": insert " << columns / insertSecs
+         << " columns/s, " << (double) bytes / columns << " bytes/column, scan " << columns / scanSecs
+         << " columns/s, 100 column ranges " << scans / rangeSecs << "/s" << (sink == 1 ? " " : "") << endl;
+  }
+}
+
+// Ingest of 1M 100 byte cells over 20K rows one insert at a time and in
+// batches of 1000, then requests reading 20 columns of 200 random rows,
+// serially with query() and with multiQuery() on 1 to 8 threads
+void benchmarkBatches() {
+  const string directory = "cassandra-bench";
+  const int cells = 1000000, rows = 20000, batchSize = 1000;
+  string value(100, 'v');
+
+  for (bool batched: {false, true}) {
+    removeDirectory(directory);
+
+    Cassandra cassandra(directory);
+    mt19937 rng(1);
+    vector<Mutation> batch;
+    auto start = chrono::steady_clock::now();
+
+    for (int i = 0; i < cells; i++) {
+      string rowKey = "row" + to_string(rng() % rows);
+      int columnKey = rng() % 1000;
+
+      if (!batched) {
+        cassandra.insert(rowKey, columnKey, value);
+        continue;
+      }
+
+      batch.push_back({rowKey, columnKey, value});
+
+      if (batch.size() == batchSize) {
+        cassandra.insertBatch(batch);
+        batch.clear();
+      }
+    }
+
+    double secs = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+    cout << (batched ? "insertBatch of 1000: " : "insert: ") << cells / secs << " cells/s" << endl;
+  }
+
+  const int requests = 200, rowsPerRequest = 200;
+
+  for (size_t threads: {1, 2, 4, 8}) {
+    CassandraOptions options;
+
+    options.queryThreads = threads;
+
+    Cassandra cassandra(directory, options);
+    mt19937 rng(2);
+    double serialSecs = 0, multiSecs = 0;
+
+    for (int r = 0; r < requests; r++) {
+      vector<string> rowKeys;
+
+      for (int k = 0; k < rowsPerRequest; k++) {
+        rowKeys.push_back("row" + to_string(rng() % rows));
+      }
+
+      int column = rng() % 980;
+
+      // Alternate which goes first, so neither always finds blocks cached
+      for (int pass = 0; pass < 2; pass++) {
+        auto start = chrono::steady_clock::now();
+
+        if ((pass + r) % 2 == 0) {
+          cassandra.multiQuery(rowKeys, column, column + 19);
+          multiSecs += chrono::duration<double>(chrono::steady_clock::now() - start).count();
+        } else if (threads == 1) {
+          for (auto& rowKey: rowKeys) {
+            cassandra.query(rowKey, column, column + 19);
+          }
+
+          serialSecs += chrono::duration<double>(chrono::steady_clock::now() - start).count();
+        }
+      }
+    }
+
+    if (threads == 1) {
+      cout << "serial query of 200 rows: " << serialSecs / requests * 1e3 << " ms" << endl;
+    }
+
+    cout << "multiQuery of 200 rows, " << threads << " threads: " << multiSecs / requests * 1e3 << " ms" << endl;
+  }
+
+  removeDirectory(directory);
+}
+
+// Simulated time for the TTL benchmark, read by the compaction thread too
+atomic<uint32_t> benchmarkNow(0);
+
+uint32_t benchmarkClock() {
+  return benchmarkNow;
+}
+
+// Time-series style rows: on-disk size with and without block compression,
+// raw decode speed of the codec, range queries with the block cache off and
+// on, and how much space compaction gives back once TTLs expire.
+void benchmarkCompression() {
+  const string directory = "cassandra-bench";
+  const int cells = 500000, rows = 2000, queries = 20000;
+  auto sample = [](mt19937& rng, int i) {
+    return "{\"host\":\"web-" + to_string(rng() % 32) + "\",\"metric\":\"cpu\",\"value\":" +
+           to_string(rng() % 100) + ",\"unit\":\"percent\",\"ts\":" + to_string(1700000000 + i) + "}";
+  };
+
+  for (bool compression: {false, true}) {
+    for (size_t cacheBytes: {(size_t) 0, (size_t) 64 << 20}) {
+      CassandraOptions options;
+
+      options.compression = compression;
+      options.blockCacheBytes = cacheBytes;
+      removeDirectory(directory);
+
+      Cassandra cassandra(directory, options);
+      mt19937 rng(1);
+
+      for (int i = 0; i < cells; i++) {
+        cassandra.insert("row" + to_string(i % rows), i / rows, sample(rng, i));
+      }
+
+      cassandra.waitForBackground();
+
+      size_t reads = 0;
+      auto start = chrono::steady_clock::now();
+
+      // Untimed pass so the cache, where there is one, is warm
+      for (int pass = 0; pass < 2; pass++) {
+        reads = cassandra.diskReads();
+        start = chrono::steady_clock::now();
+
+        for (int q = 0; q < queries; q++) {
+          int column = rng() % (cells / rows - 20);
+
+          cassandra.query("row" + to_string(rng() % rows), column, column + 19);
+        }
+      }
+
+      double secs = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+      cout << (compression ? "compressed" : "uncompressed") << (cacheBytes ? ", cache: " : ", no cache: ")
+           << cassandra.tableBytes() / 1024 << " KB on disk, range " << secs / queries * 1e6 << " us, "
+           << (double) (cassandra.diskReads() - reads) / queries << " reads/query" << endl;
+    }
+  }
+
+  // Codec alone on 4 KB blocks of the same rows
+  mt19937 rng(1);
+  vector<pair<string, size_t>> blocks;
+  size_t rawBytes = 0, packedBytes = 0;
+
+  for (int i = 0; blocks.size() < 4096; ) {
+    string block;
+
+    while (block.size() < 4096) {
+      block += sample(rng, i++);
+    }
+
+    rawBytes += block.size();
+    blocks.push_back({lzCompress(block), block.size()});
+    packedBytes += blocks.back().first.size();
+  }
+
+  string out;
+  auto start = chrono::steady_clock::now();
+
+  for (int round = 0; round < 10; round++) {
+    for (auto& block: blocks) {
+      lzDecompress(block.first, block.second, out);
+    }
+  }
+
+  double secs = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+  cout << "lz ratio " << (double) rawBytes / packedBytes << ", decode " << rawBytes * 10 / secs / (1 << 20) << " MB/s" << endl;
+
+  // Half the cells live for an hour, then a day passes
+  CassandraOptions options;
+
+  options.clock = benchmarkClock;
+  benchmarkNow = 1000;
+  removeDirectory(directory);
+
+  {
+    Cassandra cassandra(directory, options);
+
+    for (int i = 0; i < cells; i++) {
+      cassandra.insert("row" + to_string(i % rows), i / rows, sample(rng, i), i % 2 ? 3600 : 0);
+    }
+
+    size_t before = cassandra.tableBytes();
+
+    benchmarkNow += 86400;
+
+    for (int i = 0; i < cells; i++) {
+      cassandra.insert("new" + to_string(i % rows), i / rows, sample(rng, i));
+    }
+
+    cout << "ttl: " << before / 1024 << " KB before expiry, " << cassandra.expiredCount() << " expired cells dropped, "
+         << cassandra.tableBytes() / 1024 << " KB after writing as much again" << endl;
+  }
+
+  removeDirectory(directory);
+}
+
+void benchmark() {
+  benchmarkCompression();
+  benchmarkBatches();
+  benchmarkColumnStorage();
+  benchmarkStorage();
+  benchmarkLookups();
+  benchmarkWideRow();
+}
+
+int main(int argc, char* argv[]) {
+  removeDirectory("mini-cassandra");
+
+  {
+    Cassandra cassandra("mini-cassandra");
+
+    cassandra.insert("google", 1, "haha");
+  }
+
+  // Reopened from the log
+  Cassandra cassandra("mini-cassandra");
+  auto result = cassandra.query("google", 0, 1);
+
+  for (auto& r: result) {
+    cout << "col " << r.first << " value " << r.second << endl;
+  }
+
+  if (argc > 1 && string(argv[1]) == "bench") {
+    benchmark();
+  }
+}